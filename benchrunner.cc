@@ -0,0 +1,229 @@
+#include <chrono>
+#include <fstream>
+#include <functional>
+#include <random>
+#include <regex>
+#include <string>
+#include "fmt/format.h"
+#include <unistd.h>
+#include "compactzone.hh"
+#include "dnsmessages.hh"
+#include "record-types.hh"
+#include "streamregex.hh"
+
+/* Microbenchmarks for the hot paths of simplomon. Run without arguments, and it runs them all.
+   These are not tests, the numbers are for comparing before & after a change. */
+
+using namespace std;
+
+namespace {
+//! Runs f until at least 'minMsec' have passed, returns msec per run
+double timeIt(const std::function<void()>& f, double minMsec = 500)
+{
+  int runs = 0;
+  auto start = chrono::steady_clock::now();
+  double msec;
+  do {
+    f();
+    ++runs;
+    msec = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+  } while(msec < minMsec);
+  return msec / runs;
+}
+
+//! Something that looks like a web page, of 'size' bytes
+string makeBody(size_t size)
+{
+  mt19937 rng(1);
+  const vector<string> words{"<div>", "</div>", "the", "monitoring", "of", "services", "class=\"x\"", "and", "<p>", "\n", "2023", "simplomon"};
+  string ret;
+  while(ret.size() < size) {
+    ret += words[rng() % words.size()];
+    ret += ' ';
+  }
+  ret.resize(size);
+  return ret;
+}
+
+void benchRegex()
+{
+  fmt::print("StreamRegex versus std::regex, MB/s, 'never' means no match so the whole body gets searched\n");
+  for(size_t size : {1000000, 8000000}) {
+    string body = makeBody(size);
+    for(string pattern : {"Europe", "Copyright 20[0-9][0-9]", "(monitoring|services) of europe", "[a-z]+@[a-z]+\\.com", "(a|aa)+$"}) {
+      StreamRegex sre(pattern);
+      bool sm = false;
+      double smsec = timeIt([&]() {
+        StreamRegex::Search s(sre);
+        // feed the body in chunks, as curl does
+        for(size_t pos = 0; pos < body.size(); pos += 16384)
+          s.feed(string_view(body).substr(pos, 16384));
+        sm = s.finish();
+      });
+      string stdres = "skipped";
+      if(size <= 1000000) { // std::regex recurses per character, and can blow the stack on more
+        std::regex re(pattern);
+        bool m = false;
+        double msec = timeIt([&]() { m = std::regex_search(body, re); });
+        stdres = fmt::format("{:.1f}{}", size / 1000.0 / msec, m ? "" : " never");
+      }
+      fmt::print("{:>9} bytes {:<35} StreamRegex {:>8.1f}{:<6}  std::regex {}\n", size, pattern,
+                 size / 1000.0 / smsec, sm ? "" : " never", stdres);
+    }
+  }
+}
+
+//! A typical answer: a few A records, NS records in the authority section, glue and EDNS
+string makeResponse()
+{
+  DNSName name = makeDNSName("www.berthub.eu");
+  DNSMessageWriter dmw(name, DNSType::A, DNSClass::IN, 1232);
+  dmw.dh.qr = dmw.dh.aa = true;
+  for(const char* ip : {"86.82.68.237", "217.100.190.174", "100.25.31.6", "45.55.10.200"})
+    dmw.putRR(DNSSection::Answer, name, 3600, AGen::make(ip));
+  for(const char* ns : {"ns1.berthub.eu", "ns2.berthub.eu", "ns3.berthub.eu"})
+    dmw.putRR(DNSSection::Authority, makeDNSName("berthub.eu"), 86400, NSGen::make(makeDNSName(ns)));
+  dmw.putRR(DNSSection::Additional, makeDNSName("ns1.berthub.eu"), 86400, AGen::make("86.82.68.237"));
+  dmw.setEDNS(1232, false);
+  return dmw.serialize();
+}
+
+void benchDNSParse()
+{
+  fmt::print("Parsing DNS responses, responses/s\n");
+  string resp = makeResponse();
+  DNSName qname = makeDNSName("www.berthub.eu");
+  constexpr int batch = 10000;
+  unsigned int count = 0;
+
+  double msec = timeIt([&]() {
+    for(int n = 0; n < batch; ++n) {
+      DNSMessageReader dmr(resp);
+      DNSSection section;
+      DNSName dn;
+      DNSType dt;
+      uint32_t ttl;
+      std::unique_ptr<RRGen> rr;
+      while(dmr.getRR(section, dn, dt, ttl, rr))
+        count += section == DNSSection::Answer && dt == DNSType::A && dn == qname;
+    }
+  });
+  fmt::print("{:<50} {:>12.0f}\n", "DNSMessageReader, all records", batch * 1000 / msec);
+
+  msec = timeIt([&]() {
+    for(int n = 0; n < batch; ++n) {
+      DNSMessageView dmv(resp);
+      for(const auto& rr : dmv)
+        count += rr.section == DNSSection::Answer && rr.type == DNSType::A && dmv.nameEquals(rr.nameOffset, qname);
+    }
+  });
+  fmt::print("{:<50} {:>12.0f}\n", "DNSMessageView, compare names", batch * 1000 / msec);
+
+  msec = timeIt([&]() {
+    for(int n = 0; n < batch; ++n) {
+      DNSMessageView dmv(resp);
+      for(const auto& rr : dmv)
+        if(rr.section == DNSSection::Answer && rr.type == DNSType::A)
+          count += dmv.getContent(rr) != nullptr;
+    }
+  });
+  fmt::print("{:<50} {:>12.0f}\n", "DNSMessageView, make RRGen for the answers", batch * 1000 / msec);
+  if(!count)
+    fmt::print("nothing matched, benchmark is broken\n");
+}
+
+//! Resident set size of this process, in kB
+long getRSS()
+{
+  long size = 0, resident = 0;
+  ifstream("/proc/self/statm") >> size >> resident;
+  return resident * sysconf(_SC_PAGESIZE) / 1024;
+}
+
+//! The messages of an AXFR of a signed zone, where every name has an A, AAAA, TXT and RRSIG record
+vector<string> makeAXFR(const DNSName& zone, int names)
+{
+  vector<string> ret;
+  auto dmw = make_unique<DNSMessageWriter>(zone, DNSType::AXFR, DNSClass::IN, 65000);
+  auto put = [&](const DNSName& name, const std::unique_ptr<RRGen>& rr) {
+    try {
+      dmw->putRR(DNSSection::Answer, name, 3600, rr);
+    }
+    catch(std::exception&) { // full
+      ret.push_back(dmw->serialize());
+      dmw = make_unique<DNSMessageWriter>(zone, DNSType::AXFR, DNSClass::IN, 65000);
+      dmw->putRR(DNSSection::Answer, name, 3600, rr);
+    }
+  };
+  std::unique_ptr<RRGen> rrsig = std::make_unique<RRSIGGen>(DNSType::A, 12345, zone, string(64, 'x'), 3600, 1700000000, 1690000000, 13, 3);
+  for(int n = 0; n < names; ++n) {
+    DNSName name = makeDNSName(fmt::format("host{}", n)) + zone;
+    put(name, AGen::make(fmt::format("10.{}.{}.{}", n >> 16 & 0xff, n >> 8 & 0xff, n & 0xff)));
+    put(name, AAAAGen::make(fmt::format("2001:db8::{:x}:{:x}", n >> 16, n & 0xffff)));
+    put(name, TXTGen::make({fmt::format("v=spf1 ip4:10.0.0.{} -all", n % 256)}));
+    put(name, rrsig);
+  }
+  ret.push_back(dmw->serialize());
+  return ret;
+}
+
+//! Loads the same AXFR into a DNSNode tree and into a CompactZone
+void benchZoneLoad()
+{
+  constexpr int names = 250000;
+  fmt::print("Loading a zone of {} records from AXFR messages\n", names * 4);
+  DNSName zone = makeDNSName("example.com");
+  auto axfr = makeAXFR(zone, names);
+
+  auto msecSince = [](chrono::steady_clock::time_point start) {
+    return chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+  };
+  // the CompactZone goes first, it gives its memory back to the OS when it is done
+  long base = getRSS();
+  auto start = chrono::steady_clock::now();
+  CompactZone::Builder builder;
+  string rdata;
+  for(const auto& packet : axfr) {
+    DNSMessageView dmv(packet);
+    for(const auto& rr : dmv) {
+      DNSName name = dmv.getName(rr.nameOffset);
+      name.makeRelative(zone);
+      dmv.getCanonicalRdata(rr, rdata);
+      builder.add(name, rr.type, rr.ttl, {(const uint8_t*)rdata.data(), rdata.size()});
+    }
+  }
+  auto cz = builder.finish();
+  double msec = msecSince(start);
+  long rss = getRSS() - base;
+  start = chrono::steady_clock::now();
+  cz.reset();
+  fmt::print("{:<20} load {:>8.0f} msec, free {:>6.1f} msec, {:>8} kB RSS\n", "CompactZone", msec, msecSince(start), rss);
+
+  base = getRSS();
+  start = chrono::steady_clock::now();
+  auto tree = make_unique<DNSNode>();
+  for(const auto& packet : axfr) {
+    DNSMessageView dmv(packet);
+    for(const auto& rr : dmv) {
+      DNSName name = dmv.getName(rr.nameOffset);
+      name.makeRelative(zone);
+      auto node = tree->add(name);
+      node->addRRs(dmv.getContent(rr));
+      if(rr.type != DNSType::RRSIG)
+        node->rrsets[rr.type].ttl = rr.ttl;
+    }
+  }
+  msec = msecSince(start);
+  rss = getRSS() - base;
+  start = chrono::steady_clock::now();
+  tree.reset();
+  fmt::print("{:<20} load {:>8.0f} msec, free {:>6.1f} msec, {:>8} kB RSS\n", "DNSNode", msec, msecSince(start), rss);
+}
+}
+
+int main()
+{
+  benchRegex();
+  benchDNSParse();
+  benchZoneLoad();
+}
@@ -0,0 +1,86 @@
+#include "certcache.hh"
+#include <memory>
+#include <openssl/evp.h>
+#include <openssl/x509v3.h>
+
+CertCache g_certcache;
+
+namespace {
+constexpr size_t c_maxEntries = 10000;
+constexpr time_t c_maxIdle = 7 * 86400; //!< rotated certificates we no longer see
+}
+
+namespace {
+bool getValidity(X509* cert, CertValidity& v)
+{
+  struct tm notbefore={}, notafter={};
+  if(ASN1_TIME_to_tm(X509_get0_notBefore(cert), &notbefore) != 1 ||
+     ASN1_TIME_to_tm(X509_get0_notAfter(cert), &notafter) != 1)
+    return false;
+  v = {timegm(&notbefore), timegm(&notafter)};
+  return true;
+}
+}
+
+CertCache::Result CertCache::lookup(SSL* ssl, const std::string& host)
+{
+  Result ret;
+  auto chain = SSL_get_peer_cert_chain(ssl); // for a client, this includes the leaf
+  std::shared_ptr<X509> leaf(SSL_get_peer_certificate(ssl), X509_free);
+  if(!leaf)
+    return ret;
+
+  unsigned char digest[EVP_MAX_MD_SIZE];
+  unsigned int len = 0;
+  if(X509_digest(leaf.get(), EVP_sha256(), digest, &len) != 1)
+    return ret;
+  std::string key((const char*)digest, len);
+
+  time_t now = time(nullptr);
+  std::lock_guard<std::mutex> l(d_lock);
+  auto iter = d_entries.end();
+  if(chain) {
+    // a server can send a different set of intermediates with the same leaf
+    key.append(1, (char)sk_X509_num(chain));
+    iter = d_entries.find(key);
+  }
+  else {
+    /* A resumed session only has the leaf if it was stored and loaded again, like libcurl
+       does with shared sessions. The chain we saw when the session was set up is the best we have */
+    iter = d_entries.lower_bound(key);
+    if(iter == d_entries.end() || iter->first.compare(0, key.size(), key) != 0) {
+      CertValidity v;
+      if(getValidity(leaf.get(), v))
+        ret.chain.push_back(v);
+      if(!host.empty())
+        ret.hostOK = X509_check_host(leaf.get(), host.c_str(), host.size(), 0, nullptr) == 1;
+      return ret;
+    }
+  }
+
+  if(iter == d_entries.end()) {
+    if(d_entries.size() >= c_maxEntries)
+      std::erase_if(d_entries, [now](const auto& e) { return now - e.second.lastUsed > c_maxIdle; });
+    if(d_entries.size() >= c_maxEntries)
+      d_entries.clear();
+
+    Entry e;
+    for(int n = 0; n < sk_X509_num(chain); ++n) {
+      CertValidity v;
+      if(getValidity(sk_X509_value(chain, n), v))
+        e.chain.push_back(v);
+    }
+    iter = d_entries.emplace(key, std::move(e)).first;
+  }
+
+  auto& e = iter->second;
+  e.lastUsed = now;
+  ret.chain = e.chain;
+  if(!host.empty()) {
+    auto hiter = e.hostOK.find(host);
+    if(hiter == e.hostOK.end()) // this is sensitive to trailing dots
+      hiter = e.hostOK.emplace(host, X509_check_host(leaf.get(), host.c_str(), host.size(), 0, nullptr) == 1).first;
+    ret.hostOK = hiter->second;
+  }
+  return ret;
+}
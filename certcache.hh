@@ -0,0 +1,49 @@
+#pragma once
+#include <ctime>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <openssl/ssl.h>
+
+/*!
+  @file
+  @brief Process-wide cache of what we learned from TLS peer certificate chains
+
+  Certificates only change when they get rotated, so there is no need to walk the chain
+  and parse its validity windows on every probe. Entries are keyed by the SHA-256 of the
+  leaf certificate and the length of the chain, so a probe computes one digest and is done.
+*/
+
+//! The validity window of one certificate
+struct CertValidity
+{
+  time_t notBefore, notAfter;
+};
+
+class CertCache
+{
+public:
+  struct Result
+  {
+    std::vector<CertValidity> chain; //!< leaf first
+    bool hostOK = true;              //!< X509_check_host of the leaf, if a host was passed
+  };
+
+  /*! Looks at the chain the peer of ssl sent, only parses it if we haven't seen it before.
+      A resumed session can come without a chain, then we use what we saw for the same leaf
+      before, or just the leaf */
+  Result lookup(SSL* ssl, const std::string& host = std::string());
+
+private:
+  struct Entry
+  {
+    std::vector<CertValidity> chain;
+    std::map<std::string, bool> hostOK; //!< X509_check_host is not cheap either
+    time_t lastUsed;
+  };
+  std::mutex d_lock;
+  std::map<std::string, Entry> d_entries;
+};
+
+extern CertCache g_certcache;
@@ -0,0 +1,179 @@
+#include "compactzone.hh"
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <limits>
+
+using namespace std;
+
+uint8_t* Arena::allocate(size_t len)
+{
+  if(len > d_left) {
+    size_t size = max(d_blockSize, len); // a big one gets a block of its own
+    d_blocks.emplace_back(new uint8_t[size]);
+    d_next = d_blocks.back().get();
+    d_left = size;
+    d_reserved += size;
+  }
+  uint8_t* ret = d_next;
+  d_next += len;
+  d_left -= len;
+  return ret;
+}
+
+uint8_t* Arena::copy(std::span<const uint8_t> data)
+{
+  uint8_t* ret = allocate(data.size());
+  if(!data.empty())
+    memcpy(ret, data.data(), data.size());
+  return ret;
+}
+
+namespace {
+// a name has at most 127 labels
+typedef std::array<uint8_t, 128> offsets_t;
+
+//! Finds where the labels of a wire format name start, returns how many there are
+unsigned int splitName(const uint8_t* name, size_t len, offsets_t& offsets)
+{
+  unsigned int count = 0;
+  for(size_t pos = 0; pos < len; pos += 1 + name[pos])
+    offsets[count++] = pos;
+  return count;
+}
+
+string_view getLabel(const uint8_t* name, uint8_t offset)
+{
+  return string_view((const char*)name + offset + 1, name[offset]);
+}
+
+char upper(char c)
+{
+  return (c >= 0x61 && c <= 0x7A) ? c - 0x20 : c;
+}
+
+//! The same order as DNSLabel
+bool labelLess(string_view a, string_view b)
+{
+  return lexicographical_compare(a.begin(), a.end(), b.begin(), b.end(), [](char x, char y) { return upper(x) < upper(y); });
+}
+
+bool labelEquals(string_view a, string_view b)
+{
+  return equal(a.begin(), a.end(), b.begin(), b.end(), [](char x, char y) { return upper(x) == upper(y); });
+}
+}
+
+CompactZone::Builder::Builder() : d_zone(new CompactZone())
+{
+}
+
+void CompactZone::Builder::add(const DNSName& name, DNSType type, uint32_t ttl, std::span<const uint8_t> rdata)
+{
+  if(rdata.size() > std::numeric_limits<uint16_t>::max())
+    throw std::runtime_error("Record data too long for a DNS record");
+  auto wire = name.wire();
+  Staged s;
+  s.namelen = wire.size() - 1;
+  s.name = d_zone->d_arena.copy({(const uint8_t*)wire.data(), s.namelen});
+  s.rdata = d_zone->d_arena.copy(rdata);
+  s.rdlen = rdata.size();
+  s.ttl = ttl;
+  s.type = type;
+  d_staged.push_back(s);
+}
+
+/* Once the records are sorted on name, labels compared from the right, a parent comes before
+   its children, and each node's records are next to each other. So we make the nodes in one go,
+   like a depth first walk, keeping the path from the apex to where we are. */
+std::unique_ptr<CompactZone> CompactZone::Builder::finish()
+{
+  offsets_t aoff, boff;
+  sort(d_staged.begin(), d_staged.end(), [&](const Staged& a, const Staged& b) {
+    unsigned int acount = splitName(a.name, a.namelen, aoff);
+    unsigned int bcount = splitName(b.name, b.namelen, boff);
+    for(unsigned int n = 0; n < min(acount, bcount); ++n) {
+      auto alabel = getLabel(a.name, aoff[acount - n - 1]), blabel = getLabel(b.name, boff[bcount - n - 1]);
+      if(labelLess(alabel, blabel))
+        return true;
+      if(labelLess(blabel, alabel))
+        return false;
+    }
+    if(acount != bcount)
+      return acount < bcount;
+    return a.type < b.type;
+  });
+
+  auto& z = *d_zone;
+  z.d_nodes.push_back({string_view(), std::numeric_limits<uint32_t>::max()});
+  z.d_records.reserve(d_staged.size());
+  vector<uint32_t> path{0};
+  for(const auto& s : d_staged) {
+    unsigned int count = splitName(s.name, s.namelen, aoff);
+    size_t depth = 0; // how many labels we have in common with the path
+    while(depth < count && depth + 1 < path.size() &&
+          labelEquals(z.d_nodes[path[depth + 1]].label, getLabel(s.name, aoff[count - depth - 1])))
+      ++depth;
+    path.resize(depth + 1);
+    for(; depth < count; ++depth) {
+      z.d_nodes.push_back({getLabel(s.name, aoff[count - depth - 1]), path.back()});
+      path.push_back(z.d_nodes.size() - 1);
+    }
+    auto& node = z.d_nodes[path.back()];
+    if(!node.numRecords)
+      node.firstRecord = z.d_records.size();
+    ++node.numRecords;
+    z.d_records.push_back({s.rdata, s.ttl, s.rdlen, s.type});
+  }
+  d_staged.clear();
+  d_staged.shrink_to_fit();
+
+  z.d_nodes.shrink_to_fit(); // before we point into it
+  // the nodes are in depth first order, so the children of a node come in sorted order
+  for(size_t n = 1; n < z.d_nodes.size(); ++n)
+    ++z.d_nodes[z.d_nodes[n].parent].numChildren;
+  uint32_t pos = 0;
+  for(auto& node : z.d_nodes) {
+    node.firstChild = pos;
+    pos += node.numChildren;
+  }
+  z.d_children.resize(pos);
+  vector<uint32_t> filled(z.d_nodes.size());
+  for(size_t n = 1; n < z.d_nodes.size(); ++n) {
+    auto parent = z.d_nodes[n].parent;
+    z.d_children[z.d_nodes[parent].firstChild + filled[parent]++] = &z.d_nodes[n];
+  }
+  return std::move(d_zone);
+}
+
+const CompactZone::Node* CompactZone::find(const DNSName& name) const
+{
+  auto wire = name.wire();
+  offsets_t offsets;
+  auto start = (const uint8_t*)wire.data();
+  unsigned int count = splitName(start, wire.size() - 1, offsets);
+  const Node* node = &root();
+  for(unsigned int n = count; n > 0; --n) {
+    auto label = getLabel(start, offsets[n - 1]);
+    auto kids = children(*node);
+    auto iter = lower_bound(kids.begin(), kids.end(), label, [](const Node* a, string_view b) { return labelLess(a->label, b); });
+    if(iter == kids.end() || !labelEquals((*iter)->label, label))
+      return nullptr;
+    node = *iter;
+  }
+  return node;
+}
+
+DNSName CompactZone::getName(const Node& node) const
+{
+  DNSName ret;
+  for(auto us = &node; us != &root(); us = &d_nodes[us->parent])
+    ret.push_back(DNSLabel(string(us->label)));
+  return ret;
+}
+
+size_t CompactZone::memoryUsage() const
+{
+  return sizeof(*this) + d_arena.reserved() + d_nodes.capacity() * sizeof(Node) +
+    d_children.capacity() * sizeof(Node*) + d_records.capacity() * sizeof(Record);
+}
@@ -0,0 +1,127 @@
+#pragma once
+#include <cstdint>
+#include <memory>
+#include <span>
+#include <string_view>
+#include <vector>
+#include "dns-storage.hh"
+
+/*!
+  @file
+  @brief Defines CompactZone, a read-only zone tree that takes a few large allocations instead of millions of small ones
+
+  A DNSNode tree allocates per node, per child set entry, per RRSet and per record, and a
+  zone of a million records ends up spread all over the heap. CompactZone keeps labels and
+  record data in an Arena, and nodes and records in two vectors. The children of a node are
+  next to each other and sorted, the records of a node too, so lookups are binary searches and
+  walking the zone touches memory in order. Dropping the CompactZone frees it all in one go.
+
+  It can't be changed once built. To get a new version of the zone, build a new one.
+
+  ```
+  CompactZone::Builder b;
+  b.add(makeDNSName("www"), DNSType::A, 3600, rdata);
+  auto zone = b.finish();
+  if(auto node = zone->find(makeDNSName("www")))
+    for(const auto& rec : zone->records(*node))
+      ;
+  ```
+*/
+
+//! Hands out bytes from big blocks, and only frees them all at once
+class Arena
+{
+public:
+  explicit Arena(size_t blockSize = 1024 * 1024) : d_blockSize(blockSize) {}
+  Arena(const Arena&) = delete;
+  Arena(Arena&&) = default;
+  Arena& operator=(Arena&&) = default;
+
+  uint8_t* allocate(size_t len);
+  //! Copies data into the arena, and returns where it went
+  uint8_t* copy(std::span<const uint8_t> data);
+  //! Bytes taken from the heap, used or not
+  size_t reserved() const { return d_reserved; }
+
+private:
+  std::vector<std::unique_ptr<uint8_t[]>> d_blocks;
+  uint8_t* d_next{nullptr};
+  size_t d_left{0};
+  size_t d_blockSize;
+  size_t d_reserved{0};
+};
+
+class CompactZone
+{
+public:
+  struct Record
+  {
+    const uint8_t* rdata; //!< in canonical form: no compression, names lowercased
+    uint32_t ttl;
+    uint16_t rdlen;
+    DNSType type;
+    std::span<const uint8_t> getRdata() const { return {rdata, rdlen}; }
+  };
+
+  struct Node
+  {
+    std::string_view label; //!< empty for the apex
+    uint32_t parent;
+    uint32_t firstChild{0}, numChildren{0};
+    uint32_t firstRecord{0}, numRecords{0};
+  };
+
+  //! Collects records in any order, and turns them into a CompactZone
+  class Builder
+  {
+  public:
+    Builder();
+    //! name is relative to the zone, rdata has to be uncompressed
+    void add(const DNSName& name, DNSType type, uint32_t ttl, std::span<const uint8_t> rdata);
+    //! Sorts everything into place. The Builder can't be used after this
+    std::unique_ptr<CompactZone> finish();
+
+  private:
+    struct Staged
+    {
+      const uint8_t* name; //!< in wire format, without the final 0
+      const uint8_t* rdata;
+      uint32_t ttl;
+      uint16_t rdlen;
+      uint8_t namelen;
+      DNSType type;
+    };
+    std::unique_ptr<CompactZone> d_zone;
+    std::vector<Staged> d_staged;
+  };
+
+  const Node& root() const { return d_nodes.front(); }
+  //! Finds the node for name, which is relative to the zone. nullptr if it isn't there
+  const Node* find(const DNSName& name) const;
+  std::span<const Node* const> children(const Node& node) const
+  {
+    return {d_children.data() + node.firstChild, node.numChildren};
+  }
+  std::span<const Record> records(const Node& node) const
+  {
+    return {d_records.data() + node.firstRecord, node.numRecords};
+  }
+  //! All nodes, parents before their children
+  std::span<const Node> nodes() const { return d_nodes; }
+  //! The name of node, relative to the zone
+  DNSName getName(const Node& node) const;
+  //! Number of records
+  size_t size() const { return d_records.size(); }
+  //! Bytes of heap this zone holds
+  size_t memoryUsage() const;
+
+private:
+  CompactZone() = default;
+  Arena d_arena;
+  std::vector<Node> d_nodes;
+  std::vector<const Node*> d_children;
+  std::vector<Record> d_records;
+};
+
+//! Like retrieveZone, but into a CompactZone
+std::unique_ptr<CompactZone> retrieveCompactZone(const ComboAddress& remote, const DNSName& zone, double timeout = 60);
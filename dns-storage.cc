@@ -3,51 +3,168 @@
 #include <iomanip>
 using namespace std;
 
-//! Makes us relative to 'root', returns false if we weren't part of root
-bool DNSName::makeRelative(const DNSName& root)
+// DNS is case insensitive, but only for ASCII. Length bytes are never in A-Z, so this can fold whole names
+static inline uint8_t foldCase(uint8_t c)
 {
-  auto us = d_name, them=root.d_name;
-  while(!them.empty()) {
-    if(us.empty())
-      return false;
-    if(us.back() == them.back()) {
-      us.pop_back();
-      them.pop_back();
-    }
-    else
+  return (c >= 'A' && c <= 'Z') ? c + 0x20 : c;
+}
+
+//! FNV-1a over the lowercased name
+void DNSName::rehash()
+{
+  uint64_t h = 14695981039346656037ULL;
+  for(uint8_t c : d_storage) {
+    h ^= foldCase(c);
+    h *= 1099511628211ULL;
+  }
+  d_hash = h;
+}
+
+bool DNSName::equalsNoCase(const DNSName& rhs) const
+{
+  for(size_t n = 0; n < d_storage.size(); ++n)
+    if(foldCase(d_storage[n]) != foldCase(rhs.d_storage[n]))
       return false;
+  return true;
+}
+
+void DNSName::append(const DNSLabel& l)
+{
+  if(l.empty()) // would look like the end of the name
+    throw std::out_of_range("Empty label in DNS name");
+  if(l.size() > 63) // a longer one has a length byte that is not a length, and might get case folded
+    throw std::out_of_range("DNS label too long");
+  if(d_storage.size() + l.size() + 1 > 255)
+    throw std::out_of_range("DNS name too long");
+  d_storage.back() = l.size();
+  d_storage += l.d_s;
+  d_storage.append(1, '\0');
+  ++d_count;
+}
+
+void DNSName::push_front(const DNSLabel& l)
+{
+  if(l.empty())
+    throw std::out_of_range("Empty label in DNS name");
+  if(l.size() > 63) // a longer one has a length byte that is not a length, and might get case folded
+    throw std::out_of_range("DNS label too long");
+  if(d_storage.size() + l.size() + 1 > 255)
+    throw std::out_of_range("DNS name too long");
+  d_storage.insert(0, 1, (char)l.size());
+  d_storage.insert(1, l.d_s);
+  ++d_count;
+  rehash();
+}
+
+DNSLabel DNSName::back() const
+{
+  if(empty())
+    throw std::out_of_range("DNS name has no labels");
+  size_t pos = 0, last = 0;
+  while(d_storage[pos]) {
+    last = pos;
+    pos += 1 + (uint8_t)d_storage[pos];
+  }
+  return DNSLabel(d_storage.substr(last + 1, (uint8_t)d_storage[last]));
+}
+
+void DNSName::pop_front()
+{
+  if(empty())
+    throw std::out_of_range("DNS name has no labels");
+  d_storage.erase(0, 1 + (uint8_t)d_storage[0]);
+  --d_count;
+  rehash();
+}
+
+void DNSName::pop_back()
+{
+  if(empty())
+    throw std::out_of_range("DNS name has no labels");
+  size_t pos = 0, last = 0;
+  while(d_storage[pos]) {
+    last = pos;
+    pos += 1 + (uint8_t)d_storage[pos];
   }
-  d_name = us;
+  d_storage.resize(last);
+  d_storage.append(1, '\0');
+  --d_count;
+  rehash();
+}
+
+size_t DNSName::suffixPos(const DNSName& root) const
+{
+  if(root.d_storage.size() > d_storage.size())
+    return std::string::npos;
+  size_t want = d_storage.size() - root.d_storage.size(), pos = 0;
+  while(pos < want)  // only label boundaries count
+    pos += 1 + (uint8_t)d_storage[pos];
+  if(pos != want)
+    return std::string::npos;
+  for(size_t n = 0; n < root.d_storage.size(); ++n)
+    if(foldCase(d_storage[pos + n]) != foldCase(root.d_storage[n]))
+      return std::string::npos;
+  return pos;
+}
+
+//! Makes us relative to 'root', returns false if we weren't part of root
+bool DNSName::makeRelative(const DNSName& root)
+{
+  size_t pos = suffixPos(root);
+  if(pos == std::string::npos)
+    return false;
+  d_storage.resize(pos);
+  d_storage.append(1, '\0');
+  d_count -= root.d_count;
+  rehash();
   return true;
 }
 
 //! Checks is this DNSName is part of root
 bool DNSName::isPartOf(const DNSName& root) const
 {
-  auto them = root.d_name.crbegin(), us = d_name.crbegin();
+  return suffixPos(root) != std::string::npos;
+}
+
+// same order as DNSLabel::operator<, so uppercase, and a signed char
+static inline bool labelCharLess(char a, char b)
+{
+  if(a >= 0x61 && a <= 0x7A)
+    a -= 0x20;
+  if(b >= 0x61 && b <= 0x7A)
+    b -= 0x20;
+  return a < b;
+}
+
+bool DNSName::operator<(const DNSName& rhs) const
+{
+  const char* us = d_storage.data();
+  const char* them = rhs.d_storage.data();
   for(;;) {
-    if(them == root.d_name.crend())
+    if(!*them)
+      return false;
+    if(!*us)
+      return true;
+    uint8_t uslen = *us, themlen = *them;
+    if(std::lexicographical_compare(us + 1, us + 1 + uslen, them + 1, them + 1 + themlen, labelCharLess))
       return true;
-    if(us == d_name.crend())
+    if(std::lexicographical_compare(them + 1, them + 1 + themlen, us + 1, us + 1 + uslen, labelCharLess))
       return false;
-    
-    if(*them == *us) {
-      ++them;
-      ++us;
-    }
-    else
-      break;
+    us += 1 + uslen;
+    them += 1 + themlen;
   }
-  return false;
 }
 
-
 //! Append two DNSNames
 DNSName operator+(const DNSName& a, const DNSName& b)
 {
+  if(a.d_storage.size() + b.d_storage.size() - 1 > 255)
+    throw std::out_of_range("DNS name too long");
   DNSName ret=a;
-  for(const auto& l : b.d_name)
-    ret.d_name.push_back(l);
+  ret.d_storage.pop_back();
+  ret.d_storage += b.d_storage;
+  ret.d_count += b.d_count;
+  ret.rehash();
   return ret;
 }
 
@@ -191,6 +308,19 @@ void DNSNode::addRRs(std::unique_ptr<RRGen>&&a)
     rrsets[a->getType()].add(std::move(a));
 }
 
+bool DNSNode::removeRRs(const RRGen& a)
+{
+  DNSType type = a.getType();
+  if(auto rrsig = dynamic_cast<const RRSIGGen*>(&a))
+    type = rrsig->d_type;
+  auto iter = rrsets.find(type);
+  if(iter == rrsets.end() || !iter->second.remove(a))
+    return false;
+  if(iter->second.contents.empty() && iter->second.signatures.empty())
+    rrsets.erase(iter);
+  return true;
+}
+
 // Emit an escaped DNSLabel in 'master file' format
 std::ostream & operator<<(std::ostream &os, const DNSLabel& d)
 {
@@ -212,7 +342,7 @@ std::ostream & operator<<(std::ostream &os, const DNSLabel& d)
 std::ostream & operator<<(std::ostream &os, const DNSName& d)
 {
   if(d.empty()) os<<'.';
-  else for(const auto& l : d.d_name) 
+  else for(const auto& l : d) 
     os<<l<<".";
   return os;
 }
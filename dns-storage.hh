@@ -1,6 +1,9 @@
 #pragma once
 #include <strings.h>
+#include <cstring>
 #include <string>
+#include <string_view>
+#include <iterator>
 #include <set>
 #include <map>
 #include <vector>
@@ -129,41 +132,85 @@ private:
 std::ostream & operator<<(std::ostream &os, const DNSLabel& d);
 
 
-//! A DNS Name with helpful methods. Inherits case insensitivity from DNSLabel
+/*! A DNS Name with helpful methods. Case insensitive, like DNSLabel.
+    The name is stored as one string in DNS wire format, so without dots but with a length
+    byte in front of every label, and a 0 at the end. Short names fit in the string itself.
+    A hash of the lowercased name is kept up to date, so most unequal names get told apart
+    without looking at them, and equal names are usually spelled the same and found equal by a memcmp */
 struct DNSName
 {
-  DNSName() {}
-  DNSName(std::initializer_list<DNSLabel> dls) : d_name(dls) {}
-  void push_back(const DNSLabel& l) { d_name.push_back(l); }
-  auto back() const { return d_name.back(); }
-  auto begin() const { return d_name.begin(); }
-  bool empty() const { return d_name.empty(); }
-  auto end() const { return d_name.end(); }
-  auto front() const { return d_name.front(); }
-  void pop_back() { d_name.pop_back(); }
-  void pop_front() { d_name.pop_front(); }
-  auto push_front(const DNSLabel& dn) { return d_name.push_front(dn); }
-  auto size() { return d_name.size(); }
-  void clear() { d_name.clear(); }
+  //! Walks over the labels from left to right, and hands out copies of them
+  class iterator
+  {
+  public:
+    using iterator_category = std::input_iterator_tag;
+    using value_type = DNSLabel;
+    using difference_type = std::ptrdiff_t;
+    using pointer = void;
+    using reference = DNSLabel;
+
+    iterator() {}
+    explicit iterator(const char* p) : d_p(p) {}
+    DNSLabel operator*() const { return DNSLabel(std::string(d_p + 1, (uint8_t)*d_p)); }
+    iterator& operator++() { d_p += 1 + (uint8_t)*d_p; return *this; }
+    iterator operator++(int) { auto ret = *this; ++*this; return ret; }
+    bool operator==(const iterator& rhs) const { return d_p == rhs.d_p; }
+  private:
+    const char* d_p{nullptr};
+  };
+
+  DNSName() { rehash(); }
+  DNSName(std::initializer_list<DNSLabel> dls) { for(const auto& l : dls) append(l); rehash(); }
+  void push_back(const DNSLabel& l) { append(l); rehash(); }
+  DNSLabel back() const;
+  iterator begin() const { return iterator(d_storage.data()); }
+  bool empty() const { return d_count == 0; }
+  iterator end() const { return iterator(d_storage.data() + d_storage.size() - 1); } // the final 0
+  DNSLabel front() const { return *begin(); }
+  void pop_back();
+  void pop_front();
+  void push_front(const DNSLabel& l);
+  size_t size() const { return d_count; }
+  void clear() { d_storage.assign(1, '\0'); d_count = 0; rehash(); }
   bool makeRelative(const DNSName& root);
   bool isPartOf(const DNSName& root) const;
   std::string toString() const;
+  //! The name in uncompressed DNS wire format, with the 0 at the end
+  std::string_view wire() const { return d_storage; }
+  //! Equal names have equal hashes, whatever their case
+  size_t hash() const { return d_hash; }
+
   bool operator==(const DNSName& rhs) const
   {
-    return std::lexicographical_compare(begin(), end(), rhs.begin(), rhs.end())==0 &&
-      std::lexicographical_compare(rhs.begin(), rhs.end(), begin(), end())==0;
+    if(d_hash != rhs.d_hash || d_storage.size() != rhs.d_storage.size())
+      return false;
+    return !memcmp(d_storage.data(), rhs.d_storage.data(), d_storage.size()) || equalsNoCase(rhs);
   }
   bool operator!=(const DNSName& rhs) const
   {
     return !operator==(rhs);
   }
 
-  bool operator<(const DNSName& rhs) const
-  {
-    return std::lexicographical_compare(begin(), end(), rhs.begin(), rhs.end());
-  }
+  //! Compares label by label, from the left, like DNSLabel does
+  bool operator<(const DNSName& rhs) const;
 
-  std::deque<DNSLabel> d_name;
+private:
+  friend DNSName operator+(const DNSName& a, const DNSName& b);
+  void append(const DNSLabel& l);
+  void rehash();
+  bool equalsNoCase(const DNSName& rhs) const;
+  //! Where our part that matches root starts, or npos
+  size_t suffixPos(const DNSName& root) const;
+
+  std::string d_storage{std::string(1, '\0')};
+  size_t d_hash{0};
+  uint8_t d_count{0}; //!< number of labels
+};
+
+template<>
+struct std::hash<DNSName>
+{
+  size_t operator()(const DNSName& name) const { return name.hash(); }
 };
 
 // printing, concatenation
@@ -197,6 +244,19 @@ struct RRSet
     else 
       signatures.emplace_back(std::move(rr));
   }
+  //! Removes the RR with the same content as rr, returns false if there is none
+  bool remove(const RRGen& rr)
+  {
+    auto& rrs = rr.getType() != DNSType::RRSIG ? contents : signatures;
+    auto str = rr.toString();
+    for(auto iter = rrs.begin(); iter != rrs.end(); ++iter) {
+      if((*iter)->toString() == str) {
+        rrs.erase(iter);
+        return true;
+      }
+    }
+    return false;
+  }
   uint32_t ttl{3600};
 };
 
@@ -230,6 +290,8 @@ struct DNSNode
   }
   //! add one RRGen to this node  
   void addRRs(std::unique_ptr<RRGen>&&a);
+  //! remove the RR with the same content as a from this node, returns false if it was not there
+  bool removeRRs(const RRGen& a);
   //! add multiple RRGen to this node  
   template<typename... Types>
   void addRRs(std::unique_ptr<RRGen>&&a, Types&&... args)
@@ -267,4 +329,16 @@ struct DNSNode
 //! Called by main() to load zone information
 void loadZones(DNSNode& zones);
 
-std::unique_ptr<DNSNode> retrieveZone(const ComboAddress& remote, const DNSName& zone); 
+//! Transfers zone from remote with AXFR. Names in the tree are relative to zone. Throws if it takes more than timeout seconds
+std::unique_ptr<DNSNode> retrieveZone(const ComboAddress& remote, const DNSName& zone, double timeout = 60);
+
+//! What updateZone did
+struct ZoneDelta
+{
+  uint64_t added{0}, removed{0};
+  bool full{false}; //!< the server sent the whole zone instead of a diff
+};
+
+/*! Brings tree, an earlier copy of zone, up to date with IXFR. If the server sends the whole zone,
+    tree gets replaced. If this throws, tree may be half updated, so transfer the zone again */
+ZoneDelta updateZone(const ComboAddress& remote, const DNSName& zone, std::unique_ptr<DNSNode>& tree, double timeout = 60);
@@ -0,0 +1,535 @@
+#include "dnsengine.hh"
+#include "dnsmessages.hh"
+#include "kerneltime.hh"
+#include "fmt/format.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <poll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <random>
+#include <set>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+using namespace std;
+
+namespace {
+constexpr size_t c_socksPerPool = 4;
+constexpr unsigned int c_maxUses = 2000; //!< after this, a socket gets replaced, which gets us a new random port
+constexpr unsigned int c_batch = 32;     //!< messages per sendmmsg/recvmmsg call
+constexpr int c_rcvBuf = 4 * 1024 * 1024; //!< the kernel caps this at net.core.rmem_max
+constexpr auto c_tcpIdle = std::chrono::seconds(10); //!< then we close a TCP connection, before the server does
+}
+
+DNSEngine& DNSEngine::instance()
+{
+  static DNSEngine s_engine;
+  return s_engine;
+}
+
+DNSEngine::DNSEngine()
+{
+  d_wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if(d_wakefd < 0)
+    throw runtime_error(fmt::format("Unable to create eventfd for the DNS engine: {}", strerror(errno)));
+  d_thread = std::thread(&DNSEngine::worker, this);
+}
+
+DNSEngine::~DNSEngine()
+{
+  {
+    std::lock_guard<std::mutex> l(d_lock);
+    d_stop = true;
+  }
+  wake();
+  d_thread.join();
+  close(d_wakefd);
+}
+
+DNSEngine::Sock::~Sock()
+{
+  if(fd >= 0)
+    close(fd);
+}
+
+std::future<DNSEngine::Answer> DNSEngine::submit(std::string query, const ComboAddress& server, double timeout,
+                                                 std::optional<ComboAddress> local, bool tcp)
+{
+  auto promise = std::make_shared<std::promise<Answer>>();
+  auto ret = promise->get_future();
+  submit(std::move(query), server, timeout, local, [promise](std::exception_ptr e, Answer&& a) {
+    if(e)
+      promise->set_exception(e);
+    else
+      promise->set_value(std::move(a));
+  }, tcp);
+  return ret;
+}
+
+void DNSEngine::submit(std::string query, const ComboAddress& server, double timeout,
+                       std::optional<ComboAddress> local, callback_t done, bool tcp)
+{
+  DNSMessageView dmv(query); // throws if this is not a DNS message
+  if(!dmv.dh.qdcount)
+    throw std::runtime_error("DNS query without a question");
+  Query q;
+  q.packet = std::move(query);
+  q.server = server;
+  q.local = local;
+  q.timeout = timeout;
+  q.done = std::move(done);
+  q.tcp = tcp;
+  {
+    std::lock_guard<std::mutex> l(d_lock);
+    d_queue.push_back(std::move(q));
+  }
+  wake();
+}
+
+void DNSEngine::wake()
+{
+  uint64_t one = 1;
+  // this only fails if the counter is about to overflow, and then the I/O thread wakes up anyway
+  ssize_t ret = write(d_wakefd, &one, sizeof(one));
+  (void)ret;
+}
+
+DNSEngine::Sock& DNSEngine::getSock(const ComboAddress& server, const std::optional<ComboAddress>& local)
+{
+  auto& pool = d_pools[{server.sin4.sin_family, local ? local->toString() : ""}];
+  auto makeSock = [&]() {
+    auto ret = std::make_unique<Sock>();
+    ret->fd = socket(server.sin4.sin_family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(ret->fd < 0)
+      throw runtime_error(fmt::format("Unable to create DNS socket: {}", strerror(errno)));
+    // bursts of answers should not get dropped before we get to them
+    int bufsize = c_rcvBuf;
+    setsockopt(ret->fd, SOL_SOCKET, SO_RCVBUF, &bufsize, sizeof(bufsize));
+    ret->kernelTimestamps = enableKernelTimestamps(ret->fd);
+    if(local) {
+      ComboAddress l = *local;
+      l.setPort(0); // the kernel picks a random port
+      if(::bind(ret->fd, (struct sockaddr*)&l, l.getSocklen()) < 0)
+        throw runtime_error(fmt::format("Unable to bind DNS socket to {}: {}", l.toString(), strerror(errno)));
+    }
+    return ret;
+  };
+  if(pool.socks.empty())
+    for(size_t n = 0; n < c_socksPerPool; ++n)
+      pool.socks.push_back(makeSock());
+
+  auto& sock = pool.socks[pool.next++ % pool.socks.size()];
+  if(sock->uses >= c_maxUses) {
+    auto fresh = makeSock();
+    if(!sock->pending.empty())
+      d_retired.push_back(std::move(sock));
+    sock = std::move(fresh);
+  }
+  sock->uses++;
+  return *sock;
+}
+
+DNSEngine::Sock& DNSEngine::getTCP(const ComboAddress& server, const std::optional<ComboAddress>& local)
+{
+  auto& sock = d_tcp[{server, local ? local->toString() : ""}];
+  if(sock && !sock->dead)
+    return *sock;
+
+  auto ret = std::make_unique<Sock>();
+  ret->tcp = true;
+  ret->server = server;
+  ret->fd = socket(server.sin4.sin_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if(ret->fd < 0)
+    throw runtime_error(fmt::format("Unable to create DNS TCP socket: {}", strerror(errno)));
+  int one = 1;
+  setsockopt(ret->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  if(local) {
+    ComboAddress l = *local;
+    l.setPort(0);
+    if(::bind(ret->fd, (struct sockaddr*)&l, l.getSocklen()) < 0)
+      throw runtime_error(fmt::format("Unable to bind DNS TCP socket to {}: {}", l.toString(), strerror(errno)));
+  }
+  if(connect(ret->fd, (struct sockaddr*)&server, server.getSocklen()) < 0) {
+    if(errno != EINPROGRESS)
+      throw runtime_error(fmt::format("Unable to connect to {} over TCP: {}", server.toStringWithPort(), strerror(errno)));
+    ret->connecting = true;
+  }
+  ret->lastUsed = std::chrono::steady_clock::now();
+  sock = std::move(ret);
+  return *sock;
+}
+
+void DNSEngine::sendQueued(std::deque<Query>& queued)
+{
+  static std::mt19937 s_rng(std::random_device{}());
+
+  std::set<Sock*> udpSocks, tcpSocks;
+  auto now = std::chrono::steady_clock::now();
+  struct timespec nowReal;
+  clock_gettime(CLOCK_REALTIME, &nowReal);
+  for(auto& q : queued) {
+    try {
+      Sock& sock = q.tcp ? getTCP(q.server, q.local) : getSock(q.server, q.local);
+      uint16_t id;
+      do {
+        id = s_rng();
+      } while(sock.pending.count(id));
+      memcpy(&q.packet.at(0), &id, 2);
+
+      if(!q.deadline)
+        q.deadline = now + std::chrono::microseconds((int64_t)(q.timeout * 1000000));
+      auto deadline = d_deadlines.insert({*q.deadline, {&sock, id}});
+      auto& p = sock.pending[id];
+      p.sent = now;
+      p.sentReal = nowReal;
+      p.deadline = deadline;
+      p.query = std::move(q);
+
+      if(sock.tcp) {
+        uint16_t len = htons(p.query.packet.size());
+        sock.outbuf.append((const char*)&len, 2);
+        sock.outbuf.append(p.query.packet);
+        sock.lastUsed = now;
+        tcpSocks.insert(&sock);
+      }
+      else {
+        p.unsent = true;
+        sock.unsent.push_back(id);
+        udpSocks.insert(&sock);
+      }
+    }
+    catch(...) {
+      q.done(std::current_exception(), Answer());
+    }
+  }
+
+  for(auto* sock : udpSocks)
+    flushUDP(*sock);
+  for(auto* sock : tcpSocks)
+    if(!sock->connecting) // otherwise poll tells us when we can write
+      handleTCP(*sock, POLLOUT);
+}
+
+//! Hands the unsent queries on sock to the kernel, as far as it has room for them
+void DNSEngine::flushUDP(Sock& sock)
+{
+  while(!sock.unsent.empty()) {
+    size_t num = std::min((size_t)c_batch, sock.unsent.size());
+    struct mmsghdr msgs[c_batch];
+    struct iovec iovs[c_batch];
+    memset(msgs, 0, sizeof(msgs));
+    for(size_t n = 0; n < num; ++n) {
+      auto& q = sock.pending[sock.unsent[n]].query;
+      iovs[n].iov_base = (void*)q.packet.data();
+      iovs[n].iov_len = q.packet.size();
+      msgs[n].msg_hdr.msg_iov = &iovs[n];
+      msgs[n].msg_hdr.msg_iovlen = 1;
+      msgs[n].msg_hdr.msg_name = &q.server;
+      msgs[n].msg_hdr.msg_namelen = q.server.getSocklen();
+    }
+    auto now = std::chrono::steady_clock::now();
+    struct timespec nowReal;
+    clock_gettime(CLOCK_REALTIME, &nowReal);
+    int sent = sendmmsg(sock.fd, msgs, num, 0);
+    if(sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS))
+      return; // the rest goes out once poll says there is room again
+    if(sent > 0) {
+      for(int n = 0; n < sent; ++n) {
+        uint16_t id = sock.unsent.front();
+        sock.unsent.pop_front();
+        auto& p = sock.pending[id];
+        p.unsent = false;
+        p.sent = now;
+        p.sentReal = nowReal;
+        // the kernel numbers its send timestamps in the order the packets went out
+        p.txid = sock.sent;
+        sock.txids[sock.sent++] = id;
+      }
+      continue;
+    }
+    // the first one of what remains failed, report it and carry on with the others
+    auto iter = sock.pending.find(sock.unsent.front());
+    finish(sock, iter,
+           std::make_exception_ptr(runtime_error(fmt::format("Unable to send DNS query to {}: {}",
+                                                             iter->second.query.server.toStringWithPort(), strerror(errno)))),
+           Answer());
+  }
+}
+
+//! Removes the query from sock and reports e or a to whoever asked
+void DNSEngine::finish(Sock& sock, pending_t::iterator iter, std::exception_ptr e, Answer&& a)
+{
+  auto done = std::move(iter->second.query.done);
+  d_deadlines.erase(iter->second.deadline);
+  if(iter->second.txid)
+    sock.txids.erase(*iter->second.txid);
+  if(iter->second.unsent)
+    sock.unsent.erase(std::find(sock.unsent.begin(), sock.unsent.end(), iter->first));
+  sock.pending.erase(iter);
+  done(e, std::move(a));
+}
+
+//! Matches an answer to a query on sock, returns false if it is not one of ours
+bool DNSEngine::match(Sock& sock, std::string&& packet, const ComboAddress* from, time_point now, const struct timespec* received)
+{
+  if(packet.size() < sizeof(struct dnsheader))
+    return false;
+  uint16_t id;
+  memcpy(&id, packet.c_str(), 2);
+  auto iter = sock.pending.find(id);
+  if(iter == sock.pending.end())
+    return false; // late, or not for us
+  auto& p = iter->second;
+  // anyone can send us a UDP packet with the right ID, even for a query we did not send yet
+  if(from && (*from != p.query.server || p.unsent))
+    return false;
+  bool tc;
+  try {
+    DNSMessageView dmv(packet);
+    if(!dmv.sameQuestion(DNSMessageView(p.query.packet)))
+      return false;
+    tc = dmv.dh.tc;
+  }
+  catch(...) {
+    return false;
+  }
+  if(tc && !sock.tcp) { // ask again over TCP
+    Query q = std::move(p.query);
+    d_deadlines.erase(p.deadline);
+    if(p.txid)
+      sock.txids.erase(*p.txid);
+    sock.pending.erase(iter);
+    q.tcp = true;
+    d_requeue.push_back(std::move(q));
+    return true;
+  }
+  Answer a;
+  a.packet = std::move(packet);
+  a.userMsec = std::chrono::duration<double, std::milli>(now - p.sent).count();
+  a.tcp = sock.tcp;
+  if(received) {
+    // without a send timestamp, our own clock reading from just before sendmmsg() is the next best thing
+    a.kernel = p.txKernel.tv_sec && msecBetween(p.sentReal, p.txKernel) >= 0;
+    a.msec = msecBetween(a.kernel ? p.txKernel : p.sentReal, *received);
+  }
+  else
+    a.msec = a.userMsec;
+  finish(sock, iter, nullptr, std::move(a));
+  return true;
+}
+
+void DNSEngine::receive(Sock& sock)
+{
+  // send timestamps first, they belong to queries we might get the answer to below
+  uint32_t txid;
+  struct timespec ts;
+  while(sock.kernelTimestamps && readTXTimestamp(sock.fd, txid, ts)) {
+    auto iter = sock.txids.find(txid);
+    if(iter != sock.txids.end())
+      sock.pending[iter->second].txKernel = ts;
+  }
+
+  static std::vector<char> s_buf(c_batch * 65536);
+  struct mmsghdr msgs[c_batch];
+  struct iovec iovs[c_batch];
+  ComboAddress froms[c_batch];
+  union {
+    struct cmsghdr align;
+    char buf[128];
+  } cbufs[c_batch];
+  for(;;) {
+    memset(msgs, 0, sizeof(msgs));
+    for(unsigned int n = 0; n < c_batch; ++n) {
+      iovs[n].iov_base = &s_buf.at(n * 65536);
+      iovs[n].iov_len = 65536;
+      msgs[n].msg_hdr.msg_iov = &iovs[n];
+      msgs[n].msg_hdr.msg_iovlen = 1;
+      msgs[n].msg_hdr.msg_name = &froms[n];
+      msgs[n].msg_hdr.msg_namelen = sizeof(froms[n]);
+      msgs[n].msg_hdr.msg_control = cbufs[n].buf;
+      msgs[n].msg_hdr.msg_controllen = sizeof(cbufs[n].buf);
+    }
+    int got = recvmmsg(sock.fd, msgs, c_batch, MSG_DONTWAIT, nullptr);
+    if(got <= 0)
+      return;
+    auto now = std::chrono::steady_clock::now();
+    for(int n = 0; n < got; ++n) {
+      struct timespec received;
+      bool haveRX = getRXTimestamp(msgs[n].msg_hdr, received);
+      match(sock, std::string((const char*)iovs[n].iov_base, msgs[n].msg_len), &froms[n], now, haveRX ? &received : nullptr);
+    }
+    if((unsigned int)got < c_batch)
+      return;
+  }
+}
+
+//! Connects, writes what is queued and reads answers, as far as the socket lets us
+void DNSEngine::handleTCP(Sock& sock, short revents)
+{
+  if(sock.dead)
+    return;
+  if(sock.connecting) {
+    if(!(revents & (POLLOUT | POLLERR | POLLHUP)))
+      return;
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if(getsockopt(sock.fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0)
+      err = errno;
+    if(err) {
+      closeTCP(sock, fmt::format("Unable to connect to {} over TCP: {}", sock.server.toStringWithPort(), strerror(err)));
+      return;
+    }
+    sock.connecting = false;
+  }
+  while(!sock.outbuf.empty()) {
+    ssize_t sent = send(sock.fd, sock.outbuf.c_str(), sock.outbuf.size(), MSG_NOSIGNAL);
+    if(sent < 0) {
+      if(errno == EAGAIN || errno == EWOULDBLOCK)
+        break;
+      closeTCP(sock, fmt::format("Error writing to {} over TCP: {}", sock.server.toStringWithPort(), strerror(errno)));
+      return;
+    }
+    sock.outbuf.erase(0, sent);
+  }
+  if(!(revents & (POLLIN | POLLHUP | POLLERR)))
+    return;
+
+  char buf[65536];
+  bool eof = false;
+  for(;;) {
+    ssize_t got = read(sock.fd, buf, sizeof(buf));
+    if(got > 0) {
+      sock.inbuf.append(buf, got);
+      continue;
+    }
+    if(got == 0)
+      eof = true;
+    else if(errno != EAGAIN && errno != EWOULDBLOCK) {
+      closeTCP(sock, fmt::format("Error reading from {} over TCP: {}", sock.server.toStringWithPort(), strerror(errno)));
+      return;
+    }
+    break;
+  }
+  auto now = std::chrono::steady_clock::now();
+  // answers come in any order, each with a two byte length
+  while(sock.inbuf.size() >= 2) {
+    size_t len = ((uint8_t)sock.inbuf[0] << 8) | (uint8_t)sock.inbuf[1];
+    if(sock.inbuf.size() < 2 + len)
+      break;
+    if(match(sock, sock.inbuf.substr(2, len), nullptr, now, nullptr)) {
+      sock.answered++;
+      sock.lastUsed = now;
+    }
+    sock.inbuf.erase(0, 2 + len);
+  }
+  if(eof)
+    closeTCP(sock, fmt::format("{} closed the TCP connection", sock.server.toStringWithPort()));
+}
+
+/* Reports an error for every query on sock, except those that were sent over a connection
+   that worked before. The server probably closed it because it was idle, so those get one
+   more try over a new connection */
+void DNSEngine::closeTCP(Sock& sock, const std::string& reason)
+{
+  sock.dead = true;
+  while(!sock.pending.empty()) {
+    auto iter = sock.pending.begin();
+    if(sock.answered && !iter->second.query.retried) {
+      Query q = std::move(iter->second.query);
+      d_deadlines.erase(iter->second.deadline);
+      sock.pending.erase(iter);
+      q.retried = true;
+      d_requeue.push_back(std::move(q));
+    }
+    else
+      finish(sock, iter, std::make_exception_ptr(runtime_error(reason)), Answer());
+  }
+}
+
+void DNSEngine::expire(time_point now)
+{
+  while(!d_deadlines.empty() && d_deadlines.begin()->first <= now) {
+    auto [sock, id] = d_deadlines.begin()->second;
+    auto iter = sock->pending.find(id);
+    const auto& q = iter->second.query;
+    DNSMessageView dmv(q.packet);
+    auto e = std::make_exception_ptr(
+      Timeout(fmt::format("Timeout asking {} for {}|{}{}", q.server.toStringWithPort(), dmv.getName(sizeof(dnsheader)).toString(),
+                          toString(dmv.d_qtype), q.tcp ? " over TCP" : "")));
+    finish(*sock, iter, e, Answer());
+  }
+}
+
+void DNSEngine::worker()
+{
+  for(;;) {
+    std::deque<Query> queued;
+    {
+      std::lock_guard<std::mutex> l(d_lock);
+      if(d_stop)
+        break;
+      queued.swap(d_queue);
+    }
+    for(auto& q : d_requeue)
+      queued.push_back(std::move(q));
+    d_requeue.clear();
+    sendQueued(queued);
+
+    std::vector<struct pollfd> pfds{{d_wakefd, POLLIN, 0}};
+    std::vector<Sock*> socks{nullptr};
+    auto addSock = [&](Sock& s) {
+      if(!s.pending.empty()) {
+        pfds.push_back({s.fd, (short)(POLLIN | (s.unsent.empty() ? 0 : POLLOUT)), 0});
+        socks.push_back(&s);
+      }
+    };
+    for(auto& [key, pool] : d_pools)
+      for(auto& s : pool.socks)
+        addSock(*s);
+    for(auto& s : d_retired)
+      addSock(*s);
+    size_t firstTCP = pfds.size();
+    for(auto& [key, s] : d_tcp) {
+      pfds.push_back({s->fd, (short)(POLLIN | (s->connecting || !s->outbuf.empty() ? POLLOUT : 0)), 0});
+      socks.push_back(s.get());
+    }
+
+    int timeout = -1;
+    if(!d_deadlines.empty()) {
+      auto left = d_deadlines.begin()->first - std::chrono::steady_clock::now();
+      timeout = std::max(0.0, ceil(std::chrono::duration<double, std::milli>(left).count()));
+    }
+    if(!d_tcp.empty() && (timeout < 0 || timeout > 1000))
+      timeout = 1000; // to close idle connections
+    if(!d_requeue.empty())
+      timeout = 0;
+    if(poll(pfds.data(), pfds.size(), timeout) > 0) {
+      if(pfds[0].revents) {
+        uint64_t val;
+        ssize_t ret = read(d_wakefd, &val, sizeof(val));
+        (void)ret;
+      }
+      for(size_t n = 1; n < pfds.size(); ++n) {
+        if(!pfds[n].revents)
+          continue;
+        if(n < firstTCP) {
+          if(pfds[n].revents & ~POLLOUT)
+            receive(*socks[n]);
+          if(pfds[n].revents & POLLOUT)
+            flushUDP(*socks[n]);
+        }
+        else
+          handleTCP(*socks[n], pfds[n].revents);
+      }
+    }
+    auto now = std::chrono::steady_clock::now();
+    expire(now);
+    std::erase_if(d_retired, [](const auto& s) { return s->pending.empty(); });
+    std::erase_if(d_tcp, [now](const auto& s) {
+      return s.second->dead || (s.second->pending.empty() && now - s.second->lastUsed > c_tcpIdle);
+    });
+  }
+}
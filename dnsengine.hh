@@ -0,0 +1,154 @@
+#pragma once
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include "comboaddress.hh"
+#include "dns-storage.hh"
+
+/*!
+  @file
+  @brief Defines DNSEngine, which multiplexes the DNS queries of all checkers over a few sockets
+
+  Instead of opening a socket per query and blocking on it, checkers hand a query to the engine
+  and get a future back. One I/O thread sends everything that is queued with sendmmsg, reads
+  responses in batches with recvmmsg, and matches them to queries on ID, server, qname and qtype.
+  What the kernel has no room for during a burst stays queued until the socket is writable again.
+  Every socket pool (per address family and local address) has a few sockets on random ports,
+  which get replaced after a while so the source port keeps changing.
+
+  Truncated UDP answers get asked again over TCP. Per server and local address there is one
+  persistent TCP connection, over which queries are pipelined and answers may come back in any
+  order (RFC 7766). Idle connections get closed after a while.
+
+  For UDP, round trip times come from the kernel send and receive timestamps (see kerneltime.hh),
+  so a busy I/O thread does not make a server look slow. Over TCP they are what we measure.
+
+  ```
+  DNSMessageWriter dmw(makeDNSName("berthub.eu"), DNSType::A);
+  auto answer = DNSEngine::instance().submit(dmw.serialize(), ComboAddress("9.9.9.9", 53), 1.0).get();
+  DNSMessageReader dmr(answer.packet);
+  ```
+*/
+
+class DNSEngine
+{
+public:
+  struct Timeout : std::runtime_error
+  {
+    using std::runtime_error::runtime_error;
+  };
+
+  struct Answer
+  {
+    std::string packet;
+    double msec; //!< from the kernel sending the query to the kernel receiving this
+    double userMsec; //!< from handing the query to the kernel to reading this
+    bool kernel{false}; //!< if msec is from two kernel timestamps
+    bool tcp{false}; //!< because the UDP answer was truncated, or because you asked
+  };
+
+  //! The engine and its I/O thread get started on first use
+  static DNSEngine& instance();
+
+  /*! Sends query, a serialized DNS message, to server. The engine picks the ID, so a checker can
+      build its query once and submit that same string every time.
+      The future gets the response, or a Timeout exception after timeout seconds. */
+  std::future<Answer> submit(std::string query, const ComboAddress& server, double timeout,
+                             std::optional<ComboAddress> local = std::nullopt, bool tcp = false);
+
+  //! Called with the answer, or with an exception. Runs on the I/O thread, so keep it short
+  typedef std::function<void(std::exception_ptr, Answer&&)> callback_t;
+  //! Like the future version, for callers that wait for several queries at the same time
+  void submit(std::string query, const ComboAddress& server, double timeout,
+              std::optional<ComboAddress> local, callback_t done, bool tcp = false);
+
+  ~DNSEngine();
+
+private:
+  DNSEngine();
+  DNSEngine(const DNSEngine&) = delete;
+
+  typedef std::chrono::steady_clock::time_point time_point;
+  struct Query
+  {
+    std::string packet;
+    ComboAddress server;
+    std::optional<ComboAddress> local;
+    double timeout;
+    callback_t done;
+    bool tcp{false};
+    bool retried{false}; //!< over a new TCP connection, because the server closed the old one
+    std::optional<time_point> deadline; //!< set when first sent, asking again does not extend it
+  };
+  struct Sock;
+  typedef std::multimap<time_point, std::pair<Sock*, uint16_t>> deadlines_t;
+  struct Pending
+  {
+    Query query; //!< so we can ask again over TCP
+    time_point sent;
+    struct timespec sentReal; //!< CLOCK_REALTIME, like the kernel timestamps
+    struct timespec txKernel{0, 0}; //!< when the kernel sent it, if it told us
+    std::optional<uint32_t> txid; //!< number of the send timestamp
+    bool unsent{false}; //!< still in Sock::unsent
+    deadlines_t::iterator deadline;
+  };
+  typedef std::map<uint16_t, Pending> pending_t;
+  struct Sock
+  {
+    ~Sock();
+    int fd{-1};
+    unsigned int uses{0};
+    pending_t pending; //!< by ID
+    // for UDP
+    bool kernelTimestamps{false};
+    uint32_t sent{0}; //!< packets sent, which is how the kernel numbers the send timestamps
+    std::map<uint32_t, uint16_t> txids; //!< send timestamp number to ID
+    std::deque<uint16_t> unsent; //!< IDs of queries the kernel had no room for yet, in order
+    // for TCP
+    bool tcp{false}, connecting{false}, dead{false};
+    ComboAddress server;
+    std::string outbuf, inbuf;
+    unsigned int answered{0};
+    time_point lastUsed;
+  };
+  //! The sockets for one address family and local address
+  struct Pool
+  {
+    std::vector<std::unique_ptr<Sock>> socks;
+    unsigned int next{0};
+  };
+
+  void worker();
+  void sendQueued(std::deque<Query>& queued);
+  void flushUDP(Sock& sock);
+  void receive(Sock& sock);
+  bool match(Sock& sock, std::string&& packet, const ComboAddress* from, time_point now, const struct timespec* received);
+  void finish(Sock& sock, pending_t::iterator iter, std::exception_ptr e, Answer&& a);
+  void expire(time_point now);
+  Sock& getSock(const ComboAddress& server, const std::optional<ComboAddress>& local);
+  Sock& getTCP(const ComboAddress& server, const std::optional<ComboAddress>& local);
+  void handleTCP(Sock& sock, short revents);
+  void closeTCP(Sock& sock, const std::string& reason);
+  void wake();
+
+  std::mutex d_lock;
+  std::deque<Query> d_queue; //!< submitted, not yet sent
+  bool d_stop{false};
+  int d_wakefd;              //!< eventfd that gets the I/O thread out of poll
+  // below is only touched by the I/O thread
+  std::map<std::pair<int, std::string>, Pool> d_pools; //!< by family & local address
+  std::vector<std::unique_ptr<Sock>> d_retired; //!< replaced sockets that still have queries out
+  std::map<std::pair<ComboAddress, std::string>, std::unique_ptr<Sock>> d_tcp; //!< by server & local address
+  std::deque<Query> d_requeue; //!< to be sent again over TCP
+  deadlines_t d_deadlines;
+  std::thread d_thread;
+};
@@ -6,9 +6,30 @@ DNSMessageReader::DNSMessageReader(const char* in, uint16_t size)
 {
   if(size < sizeof(dnsheader))
     throw std::runtime_error("DNS message too small");
-  memcpy(&dh, in, sizeof(dh));
-  payload.reserve(size-12);
-  payload.insert(payload.begin(), (const unsigned char*)in + 12, (const unsigned char*)in + size);
+  d_storage = std::make_shared<uint8_t[]>(size);
+  memcpy(d_storage.get(), in, size);
+  parse(std::span<const uint8_t>(d_storage.get(), size));
+}
+
+DNSMessageReader::DNSMessageReader(std::span<const uint8_t> packet)
+{
+  if(packet.size() < sizeof(dnsheader))
+    throw std::runtime_error("DNS message too small");
+  parse(packet);
+}
+
+DNSMessageReader::DNSMessageReader(std::span<const uint8_t> packet, uint16_t pos, uint16_t len)
+{
+  memcpy(&dh, packet.data(), sizeof(dh));
+  payload = packet.subspan(sizeof(dnsheader));
+  payloadpos = pos - sizeof(dnsheader);
+  d_endofrecord = payloadpos + len;
+}
+
+void DNSMessageReader::parse(std::span<const uint8_t> packet)
+{
+  memcpy(&dh, packet.data(), sizeof(dh));
+  payload = packet.subspan(sizeof(dnsheader));
 
   if(dh.qdcount) { // AXFR can skip this
     xfrName(d_qname);
@@ -36,6 +57,7 @@ void DNSMessageReader::xfrName(DNSName& res, uint16_t* pos)
 {
   if(!pos) pos = &payloadpos;
   res.clear();
+  uint16_t namestart = *pos;
   for(;;) {
     uint8_t labellen= getUInt8(pos);
     if(labellen & 0xc0) {
@@ -43,12 +65,12 @@ void DNSMessageReader::xfrName(DNSName& res, uint16_t* pos)
       uint16_t newpos = ((labellen & ~0xc0) << 8) | labellen2;
       newpos -= sizeof(dnsheader); // includes struct dnsheader
 
-      if(newpos < *pos) {
+      if(newpos < namestart) { // else a pointer back into this name loops forever
         res=res+getName(&newpos);
         return;
       }
       else {
-        throw std::runtime_error("forward compression: " + std::to_string(newpos) + " >= " + std::to_string(*pos));
+        throw std::runtime_error("forward compression: " + std::to_string(newpos) + " >= " + std::to_string(namestart));
       }
     }
     if(!labellen) // end of DNSName
@@ -101,19 +123,259 @@ bool DNSMessageReader::getRR(DNSSection& section, DNSName& name, DNSType& type,
   xfrUInt32(ttl);
   auto len = getUInt16();
   d_endofrecord = payloadpos + len;
+  content = makeRRGen(*this, type, len);
+  return true;
+}
+
+std::unique_ptr<RRGen> DNSMessageReader::makeRRGen(DNSMessageReader& dmr, DNSType type, uint16_t len)
+{
   // this should care about RP, AFSDB too (RFC3597).. if anyone cares
-#define CONVERT(x) if(type == DNSType::x) { content = std::make_unique<x##Gen>(*this);} else
+#define CONVERT(x) if(type == DNSType::x) { return std::make_unique<x##Gen>(dmr);} else
   CONVERT(A) CONVERT(AAAA) CONVERT(NS) CONVERT(SOA) CONVERT(MX) CONVERT(CNAME)
   CONVERT(NAPTR) CONVERT(SRV)
   CONVERT(TXT) CONVERT(RRSIG)
   CONVERT(PTR) 
   {
-    content = std::make_unique<UnknownGen>(type, getBlob(len));
+    return std::make_unique<UnknownGen>(type, dmr.getBlob(len));
   }
 #undef CONVERT
+}
+
+DNSMessageView::DNSMessageView(std::span<const uint8_t> packet) : d_packet(packet)
+{
+  if(packet.size() < sizeof(dnsheader))
+    throw std::runtime_error("DNS message too small");
+  memcpy(&dh, packet.data(), sizeof(dh));
+  d_qdcount = ntohs(dh.qdcount);
+  d_ancount = ntohs(dh.ancount);
+  d_nscount = ntohs(dh.nscount);
+  d_rrcount = d_ancount + d_nscount + ntohs(dh.arcount);
+
+  uint16_t pos = sizeof(dnsheader);
+  for(int n = 0; n < d_qdcount; ++n) { // only the first question is kept
+    uint16_t qpos = skipName(pos);
+    if(qpos + 4u > d_packet.size())
+      throw std::out_of_range("DNS question beyond end of packet");
+    if(!n) {
+      d_qnameEnd = qpos;
+      d_qtype = (DNSType)(d_packet[qpos] << 8 | d_packet[qpos + 1]);
+      d_qclass = (DNSClass)(d_packet[qpos + 2] << 8 | d_packet[qpos + 3]);
+    }
+    pos = qpos + 4;
+  }
+  d_rrstart = pos;
+}
+
+// returns the position just beyond the name at pos, without following compression pointers
+uint16_t DNSMessageView::skipName(uint16_t pos) const
+{
+  for(;;) {
+    if(pos >= d_packet.size())
+      throw std::out_of_range("DNS name beyond end of packet");
+    uint8_t labellen = d_packet[pos];
+    if((labellen & 0xc0) == 0xc0)
+      return pos + 2;
+    if(labellen & 0xc0)
+      throw std::runtime_error("Unsupported DNS label type");
+    pos += labellen + 1;
+    if(!labellen)
+      return pos;
+  }
+}
+
+void DNSMessageView::parseRR(iterator& iter) const
+{
+  auto& rr = iter.d_rr;
+  if(iter.d_num < d_ancount)
+    rr.section = DNSSection::Answer;
+  else if(iter.d_num < d_ancount + d_nscount)
+    rr.section = DNSSection::Authority;
+  else
+    rr.section = DNSSection::Additional;
+
+  rr.nameOffset = iter.d_pos;
+  size_t pos = skipName(iter.d_pos);
+  if(pos + 10 > d_packet.size())
+    throw std::out_of_range("DNS record beyond end of packet");
+  const uint8_t* p = d_packet.data() + pos;
+  rr.type = (DNSType)(p[0] << 8 | p[1]);
+  rr.dclass = (DNSClass)(p[2] << 8 | p[3]);
+  rr.ttl = (uint32_t)p[4] << 24 | p[5] << 16 | p[6] << 8 | p[7];
+  uint16_t len = p[8] << 8 | p[9];
+  pos += 10;
+  if(pos + len > d_packet.size())
+    throw std::out_of_range("DNS record data beyond end of packet");
+  rr.rdataOffset = pos;
+  rr.rdata = d_packet.subspan(pos, len);
+  iter.d_pos = pos + len;
+}
+
+DNSMessageView::iterator DNSMessageView::begin() const
+{
+  iterator ret;
+  ret.d_view = this;
+  ret.d_pos = d_rrstart;
+  if(d_rrcount)
+    parseRR(ret);
+  return ret;
+}
+
+DNSMessageView::iterator DNSMessageView::end() const
+{
+  iterator ret;
+  ret.d_view = this;
+  ret.d_num = d_rrcount;
+  return ret;
+}
+
+DNSMessageView::iterator& DNSMessageView::iterator::operator++()
+{
+  if(++d_num < d_view->d_rrcount)
+    d_view->parseRR(*this);
+  return *this;
+}
+
+// DNS is case insensitive, but only for ASCII
+static inline uint8_t asciiLower(uint8_t c)
+{
+  return (c >= 'A' && c <= 'Z') ? c + 0x20 : c;
+}
+
+/* Compression pointers have to point backwards, like DNSMessageReader::xfrName wants,
+   so this always ends */
+bool DNSMessageView::nameEquals(uint16_t pos, const DNSName& name) const
+{
+  std::string_view wire = name.wire();
+  size_t wpos = 0;
+  uint16_t labelstart = pos;
+  for(;;) {
+    if(pos >= d_packet.size())
+      throw std::out_of_range("DNS name beyond end of packet");
+    uint8_t labellen = d_packet[pos];
+    if((labellen & 0xc0) == 0xc0) {
+      if(pos + 1u >= d_packet.size())
+        throw std::out_of_range("DNS name beyond end of packet");
+      uint16_t newpos = (labellen & ~0xc0) << 8 | d_packet[pos + 1];
+      if(newpos >= labelstart)
+        throw std::runtime_error("forward compression: " + std::to_string(newpos) + " >= " + std::to_string(labelstart));
+      pos = labelstart = newpos;
+      continue;
+    }
+    // wire ends with a 0, so this also catches us having more labels than name
+    if((uint8_t)wire[wpos] != labellen)
+      return false;
+    if(!labellen)
+      return true;
+    if(pos + 1u + labellen > d_packet.size())
+      throw std::out_of_range("DNS name beyond end of packet");
+    for(unsigned int n = 1; n <= labellen; ++n)
+      if(asciiLower(d_packet[pos + n]) != asciiLower(wire[wpos + n]))
+        return false;
+    wpos += labellen + 1;
+    pos += labellen + 1;
+  }
+}
+
+uint16_t DNSMessageView::appendCanonicalName(uint16_t pos, std::string& out) const
+{
+  uint16_t labelstart = pos, ret = 0;
+  size_t start = out.size();
+  for(;;) {
+    if(pos >= d_packet.size())
+      throw std::out_of_range("DNS name beyond end of packet");
+    uint8_t labellen = d_packet[pos];
+    if((labellen & 0xc0) == 0xc0) {
+      if(pos + 1u >= d_packet.size())
+        throw std::out_of_range("DNS name beyond end of packet");
+      uint16_t newpos = (labellen & ~0xc0) << 8 | d_packet[pos + 1];
+      if(newpos >= labelstart)
+        throw std::runtime_error("forward compression: " + std::to_string(newpos) + " >= " + std::to_string(labelstart));
+      if(!ret)
+        ret = pos + 2;
+      pos = labelstart = newpos;
+      continue;
+    }
+    if(labellen & 0xc0)
+      throw std::runtime_error("Unsupported DNS label type");
+    if(pos + 1u + labellen > d_packet.size())
+      throw std::out_of_range("DNS name beyond end of packet");
+    if(out.size() - start + labellen + 1 > 255)
+      throw std::out_of_range("DNS name too long");
+    out.append(1, (char)labellen);
+    for(unsigned int n = 1; n <= labellen; ++n)
+      out.append(1, (char)asciiLower(d_packet[pos + n]));
+    pos += labellen + 1;
+    if(!labellen)
+      return ret ? ret : pos;
+  }
+}
+
+void DNSMessageView::getCanonicalRdata(const RRView& rr, std::string& out) const
+{
+  out.clear();
+  uint16_t pos = rr.rdataOffset, end = rr.rdataOffset + rr.rdata.size();
+  auto raw = [&](unsigned int len) {
+    if(pos + len > end)
+      throw std::out_of_range("DNS record data too short for its type");
+    out.append((const char*)d_packet.data() + pos, len);
+    pos += len;
+  };
+  // where the names are in the types that have them
+  switch(rr.type) {
+  case DNSType::NS:
+  case DNSType::CNAME:
+  case DNSType::PTR:
+    pos = appendCanonicalName(pos, out);
+    break;
+  case DNSType::MX:
+    raw(2);
+    pos = appendCanonicalName(pos, out);
+    break;
+  case DNSType::SRV:
+    raw(6);
+    pos = appendCanonicalName(pos, out);
+    break;
+  case DNSType::SOA:
+    pos = appendCanonicalName(pos, out);
+    pos = appendCanonicalName(pos, out);
+    break;
+  case DNSType::RRSIG:
+    raw(18);
+    pos = appendCanonicalName(pos, out);
+    break;
+  default:
+    break;
+  }
+  if(pos > end)
+    throw std::out_of_range("DNS name beyond end of record data");
+  raw(end - pos);
+}
+
+// the question name comes first, so it can't be compressed
+bool DNSMessageView::sameQuestion(const DNSMessageView& rhs) const
+{
+  if(!d_qdcount || !rhs.d_qdcount || d_qtype != rhs.d_qtype || d_qclass != rhs.d_qclass)
+    return false;
+  if(d_qnameEnd != rhs.d_qnameEnd)
+    return false;
+  for(uint16_t pos = sizeof(dnsheader); pos < d_qnameEnd; ++pos)
+    if(asciiLower(d_packet[pos]) != asciiLower(rhs.d_packet[pos]))
+      return false;
   return true;
 }
 
+DNSName DNSMessageView::getName(uint16_t offset) const
+{
+  DNSMessageReader dmr(d_packet, offset, 0);
+  return dmr.getName();
+}
+
+std::unique_ptr<RRGen> DNSMessageView::getContent(const RRView& rr) const
+{
+  DNSMessageReader dmr(d_packet, rr.rdataOffset, rr.rdata.size());
+  return DNSMessageReader::makeRRGen(dmr, rr.type, rr.rdata.size());
+}
+
 // this is required to make the std::unique_ptr to DNSZone work. Long story.
 DNSMessageWriter::~DNSMessageWriter() = default;
 
@@ -131,7 +393,7 @@ void DNSMessageWriter::xfrName(const DNSName& name, bool compress)
   if(compress && !d_nocompress)  {
     auto node = d_comptree->find(fname, flast);
     
-    if(node) {
+    if(node && node->namepos) { // names beyond where a pointer can reach don't get a namepos
       //      cout<<" Did lookup for "<<oname<<", left: "<<fname<<", node: "<<flast<<", pos: "<<node->namepos<<endl;
       if(flast.size() >= 1) {
         uint16_t pos = node->namepos;
@@ -140,7 +402,7 @@ void DNSMessageWriter::xfrName(const DNSName& name, bool compress)
         DNSName sname(oname);
         for(const auto& lab : fname) {
           auto anode = d_comptree->add(sname);
-          if(!anode->namepos) {
+          if(!anode->namepos && payloadpos + 12 < 0x4000) { // a pointer only has 14 bits
             //            cout<<"Storing that "<<sname<<" can be found at " << payloadpos + 12 << endl;
             anode->namepos = payloadpos + 12;
           }
@@ -158,7 +420,7 @@ void DNSMessageWriter::xfrName(const DNSName& name, bool compress)
   for(const auto& l : name) {
     if(!d_nocompress) { // even with compress=false, we want to store this name, unless this is a nocompress message (AXFR)
       auto anode = d_comptree->add(oname);
-      if(!anode->namepos) {
+      if(!anode->namepos && payloadpos + 12 < 0x4000) { // a pointer only has 14 bits
         //        cout<<"Storing that "<<oname<<" can be found at " << payloadpos + 12 << endl;
         anode->namepos = payloadpos + 12;
       }
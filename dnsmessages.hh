@@ -2,21 +2,28 @@
 #include "dns-storage.hh"
 #include "record-types.hh"
 #include <arpa/inet.h>
+#include <iterator>
+#include <memory>
+#include <span>
+#include <string_view>
 #include <vector>
 
 /*!
   @file
-  @brief Defines DNSMessageReader and DNSMessageWriter
+  @brief Defines DNSMessageReader, DNSMessageView and DNSMessageWriter
 */
 
 //! A class that parses a DNS Message 
 class DNSMessageReader
 {
 public:
+  //! Copies the message, so input can go away
   DNSMessageReader(const char* input, uint16_t length);
   DNSMessageReader(const std::string& str) : DNSMessageReader(str.c_str(), str.size()) {}
+  //! Does not copy, so packet has to stay around as long as this reader
+  explicit DNSMessageReader(std::span<const uint8_t> packet);
   struct dnsheader dh=dnsheader{}; //!< the DNS header
-  std::vector<uint8_t> payload;    //!< The payload
+  std::span<const uint8_t> payload; //!< The payload, so without the header
   uint16_t payloadpos{0};          //!< Current position of processing
   uint16_t rrpos{0};               //!< Used in getRR to set section correctly
   uint16_t d_endofrecord;
@@ -44,7 +51,8 @@ public:
   void xfrUInt8(uint8_t&res, uint16_t* pos = 0)
   {
     if(!pos) pos = &payloadpos;
-    res=payload.at((*pos)++);
+    res=*at(*pos, 1);
+    (*pos)++;
   }
   //! Convenience form that returns the next 8 bit integer, or from pos
   uint8_t getUInt8(uint16_t* pos=0) 
@@ -53,7 +61,7 @@ public:
   //! Gets the next 16 bit unsigned integer from the message
   void xfrUInt16(uint16_t& res)
   {
-    memcpy(&res, &payload.at(payloadpos+1)-1, 2);
+    memcpy(&res, at(payloadpos, 2), 2);
     payloadpos+=2;
     res=htons(res);
   }
@@ -71,7 +79,7 @@ public:
   //! Gets the next 32 bit unsigned integer from the message
   void xfrUInt32(uint32_t& res)
   {
-    memcpy(&res, &payload.at(payloadpos+3)-3, 4);
+    memcpy(&res, at(payloadpos, 4), 4);
     payloadpos+=4;
     res=ntohl(res);
   }
@@ -89,7 +97,7 @@ public:
       blob.clear();
       return;
     }
-    blob.assign(&payload.at(*pos), &payload.at(*pos+size-1)+1);
+    blob.assign((const char*)at(*pos, size), size);
     (*pos) += size;
   }
 
@@ -107,8 +115,114 @@ public:
   uint16_t d_bufsize;
   bool d_doBit{false};
   bool d_haveEDNS{false};
+
+  //! Parses the record data at the current position into the right RRGen, or an UnknownGen
+  static std::unique_ptr<RRGen> makeRRGen(DNSMessageReader& dmr, DNSType type, uint16_t len);
+private:
+  friend class DNSMessageView;
+  //! Positioned on the len bytes of record data at pos, used by DNSMessageView
+  DNSMessageReader(std::span<const uint8_t> packet, uint16_t pos, uint16_t len);
+  void parse(std::span<const uint8_t> packet);
+  //! Checks that len bytes at pos are within the payload
+  const uint8_t* at(size_t pos, size_t len) const
+  {
+    if(pos + len > payload.size())
+      throw std::out_of_range("Attempt to read beyond end of DNS message");
+    return payload.data() + pos;
+  }
+  std::shared_ptr<uint8_t[]> d_storage; //!< if we copied the message, shared so copies of us stay valid
 }; 
 
+/*! A DNS message parser that does not copy the packet and does not allocate.
+    Iterating over it yields RRView's, which point into the packet. Names are left in wire format,
+    and only get turned into a DNSName, or the record data into an RRGen, when you ask.
+    The packet has to stay around as long as the view, and the RRView's.
+
+    ```
+    DNSMessageView dmv(packet);
+    for(const auto& rr : dmv)
+      if(rr.section == DNSSection::Answer && rr.type == DNSType::A && dmv.nameEquals(rr.nameOffset, qname))
+        cout << dmv.getContent(rr)->toString() << endl;
+    ```
+*/
+class DNSMessageView
+{
+public:
+  explicit DNSMessageView(std::span<const uint8_t> packet);
+  explicit DNSMessageView(std::string_view packet)
+    : DNSMessageView(std::span<const uint8_t>((const uint8_t*)packet.data(), packet.size())) {}
+
+  //! A resource record, as it sits in the packet
+  struct RRView
+  {
+    DNSSection section;
+    uint16_t nameOffset;   //!< where the owner name starts, counted from the start of the packet
+    DNSType type;
+    DNSClass dclass;
+    uint32_t ttl;
+    uint16_t rdataOffset;  //!< also from the start of the packet
+    std::span<const uint8_t> rdata;
+  };
+
+  class iterator
+  {
+  public:
+    using iterator_category = std::input_iterator_tag;
+    using value_type = RRView;
+    using difference_type = std::ptrdiff_t;
+    using pointer = const RRView*;
+    using reference = const RRView&;
+
+    const RRView& operator*() const { return d_rr; }
+    const RRView* operator->() const { return &d_rr; }
+    iterator& operator++();
+    bool operator==(const iterator& rhs) const { return d_num == rhs.d_num; }
+  private:
+    friend class DNSMessageView;
+    const DNSMessageView* d_view{nullptr};
+    uint16_t d_pos{0};   //!< where the next RR starts
+    unsigned int d_num{0};
+    RRView d_rr{};
+  };
+
+  //! Parses the first RR, so this throws on a malformed message
+  iterator begin() const;
+  iterator end() const;
+  //! Number of RRs in the answer, authority and additional sections
+  unsigned int size() const { return d_rrcount; }
+
+  //! Compares the name at offset with name, case insensitively, without making a DNSName
+  bool nameEquals(uint16_t offset, const DNSName& name) const;
+  //! True if the question section asks for name and type
+  bool isQuestion(const DNSName& name, DNSType type) const
+  {
+    return d_qdcount && d_qtype == type && nameEquals(sizeof(dnsheader), name);
+  }
+  //! True if rhs has the same question, without caring about case
+  bool sameQuestion(const DNSMessageView& rhs) const;
+  //! Makes a DNSName out of the name at offset
+  DNSName getName(uint16_t offset) const;
+  //! Parses the record data of rr into an RRGen
+  std::unique_ptr<RRGen> getContent(const RRView& rr) const;
+  /*! Puts the record data of rr in out, with the names in it uncompressed and lowercased, so two
+      records with the same content get the same bytes. Reuses the space in out */
+  void getCanonicalRdata(const RRView& rr, std::string& out) const;
+  //! Appends the name at pos to out, uncompressed and lowercased. Returns where the name ends in the packet
+  uint16_t appendCanonicalName(uint16_t pos, std::string& out) const;
+
+  struct dnsheader dh=dnsheader{}; //!< the DNS header, in network order
+  DNSType d_qtype{(DNSType)0};
+  DNSClass d_qclass{(DNSClass)0};
+private:
+  uint16_t skipName(uint16_t pos) const;
+  void parseRR(iterator& iter) const;
+  std::span<const uint8_t> d_packet;
+  uint16_t d_qdcount{0}, d_ancount{0}, d_nscount{0};
+  unsigned int d_rrcount{0};
+  uint16_t d_rrstart{0};
+  uint16_t d_qnameEnd{0};
+};
+
 //! A DNS Message writer
 class DNSMessageWriter
 {
@@ -7,7 +7,11 @@
 #include "fmt/chrono.h"
 #include "simplomon.hh"
 #include "support.hh"
+#include "dnsengine.hh"
+#include "compactzone.hh"
+#include <condition_variable>
 #include <fstream>
+#include <poll.h>
 
 using namespace std;
 
@@ -65,14 +69,42 @@ catch(...) {
 }
 
 
+//! The queries of a checker never change, except for the ID, which the DNSEngine picks
+static string makeQuery(const DNSName& name, DNSType type, bool rd, bool doBit)
+{
+  DNSMessageWriter dmw(name, type);
+  dmw.dh.rd = rd;
+  dmw.setEDNS(4000, doBit);
+  return dmw.serialize();
+}
+
+/* An acceptable answer in master file format, in the form that DNSMessageView::getCanonicalRdata
+   makes of the record data in an answer. So we go through a DNS message */
+static string makeCanonicalRdata(DNSType type, const string& content)
+{
+  DNSMessageWriter dmw(DNSName(), type);
+  dmw.d_nocompress = true;
+  dmw.putRR(DNSSection::Answer, DNSName(), 0, makeRRGen(type, content));
+  string packet = dmw.serialize();
+  DNSMessageView dmv(packet);
+  string ret;
+  dmv.getCanonicalRdata(*dmv.begin(), ret);
+  return ret;
+}
+
 DNSChecker::DNSChecker(sol::table data) : Checker(data, 2)
 {
   checkLuaTable(data, {"server", "name", "type"}, {"rd", "acceptable", "localIP"});
   d_nsip = ComboAddress(data.get<string>("server"), 53);
   d_qname = makeDNSName(data.get<string>("name"));
   d_qtype = makeDNSType(data.get<string>("type").c_str());
-  for(const auto& a : data.get_or("acceptable", vector<string>()))
+  // for types we can't parse, we compare the text like we used to
+  d_textMatch = !canMakeRRGen(d_qtype);
+  for(const auto& a : data.get_or("acceptable", vector<string>())) {
     d_acceptable.insert(a);
+    if(!d_textMatch)
+      d_acceptableRdata.insert(makeCanonicalRdata(d_qtype, a));
+  }
   d_rd = data.get_or("rd", true);
   string localip= data.get_or("localIP", string(""));
   if(!localip.empty()) {
@@ -84,82 +116,59 @@ DNSChecker::DNSChecker(sol::table data) : Checker(data, 2)
   d_attributes["name"] = d_qname.toString();
   d_attributes["type"] = toString(d_qtype);
   d_attributes["rd"] = d_rd;
+  d_query = makeQuery(d_qname, d_qtype, d_rd, false);
 }
 
 CheckResult DNSChecker::perform()
 {
-  DNSMessageWriter dmw(d_qname, d_qtype);
-          
-  dmw.dh.rd = true;
-  dmw.randomizeID();
-  dmw.setEDNS(4000, false);
-  
-  Socket sock(d_nsip.sin4.sin_family, SOCK_DGRAM);
-  if(d_localIP) {
-    SBind(sock, *d_localIP);
-  }
-
-  SConnect(sock, d_nsip);
-
   d_results.clear();
-  DTime dti; 
-  SWrite(sock, dmw.serialize());
-
-  ComboAddress server;
-
-  double timeo=0.5;
-  if(!waitForData(sock, &timeo)) { // timeout
+  DNSEngine::Answer answer;
+  try {
+    answer = DNSEngine::instance().submit(d_query, d_nsip, 0.5, d_localIP).get();
+  }
+  catch(DNSEngine::Timeout&) {
     return fmt::format("Timeout asking DNS question for {}|{} to {}",
                           d_qname.toString(), toString(d_qtype), d_nsip.toStringWithPort());
   }
     
-  string resp = SRecvfrom(sock, 65535, server);
-  d_results[""]["msec"] = dti.lapUsec() / 1000.0;
-  DNSMessageReader dmr(resp);
-  
-  DNSSection rrsection;
-  uint32_t ttl;
-
-  DNSName dn;
-  DNSType dt;
-  dmr.getQuestion(dn, dt);
+  d_results[""]["msec"] = answer.msec;
+  d_results[""]["user-msec"] = answer.userMsec;
+  string resp = std::move(answer.packet);
+  DNSMessageView dmv(resp);
   
-  //  cout<<"Received "<<resp.size()<<" byte response with RCode "<<(RCode)dmr.dh.rcode<<", qname " <<dn<<", qtype "<<dt<<endl;
-
-  if((RCode)dmr.dh.rcode != RCode::Noerror) {
+  if((RCode)dmv.dh.rcode != RCode::Noerror) {
     return fmt::format("Got DNS response with RCode {} from {} for question {}|{}",
-                       toString((RCode)dmr.dh.rcode), d_qname.toString(), d_nsip.toStringWithPort(), toString(d_qtype));
+                       toString((RCode)dmv.dh.rcode), d_nsip.toStringWithPort(), d_qname.toString(), toString(d_qtype));
   }
   
-  std::unique_ptr<RRGen> rr;
-
   int matches = 0;
-  vector<string> finals;
-  while(dmr.getRR(rrsection, dn, dt, ttl, rr)) {
-    if(rrsection == DNSSection::Answer && dt == d_qtype) {
-      //  cout << rrsection<<" "<<dn<< " IN " << dt << " " << ttl << " " <<rr->toString()<<endl;
-      finals.push_back(dn.toString()+" "+rr->toString());
-      if(d_acceptable.empty())
-        matches++;
-      else {
-        if(dt == DNSType::NS) {
-          set<DNSName> acc;
-          for(const auto& a : d_acceptable)
-            acc.insert(makeDNSName(a));
-          if(!acc.count(dynamic_cast<NSGen*>(rr.get())->d_name)) {
-            return fmt::format("Unacceptable DNS answer {} for question {} from {}. Acceptable: {}", rr->toString(), d_qname.toString(), d_nsip.toStringWithPort(), d_acceptable);
-          }
-          else matches++;
-        }
-        else if(!d_acceptable.count(rr->toString())) {
-          return fmt::format("Unacceptable DNS answer {} for question {} from {}. Acceptable: {}", rr->toString(), d_qname.toString(), d_nsip.toStringWithPort(), d_acceptable);
-        }
-        else matches++;
-      }
+  string rdata, answers;
+  for(const auto& rr : dmv) {
+    if(rr.section != DNSSection::Answer || rr.type != d_qtype)
+      continue;
+    dmv.getCanonicalRdata(rr, rdata);
+    bool acceptable = d_textMatch ? (d_acceptable.empty() || d_acceptable.count(dmv.getContent(rr)->toString())) :
+      (d_acceptableRdata.empty() || d_acceptableRdata.count(rdata));
+    if(!acceptable) {
+      return fmt::format("Unacceptable DNS answer {} for question {} from {}. Acceptable: {}", dmv.getContent(rr)->toString(), d_qname.toString(), d_nsip.toStringWithPort(), d_acceptable);
     }
+    matches++;
+    dmv.appendCanonicalName(rr.nameOffset, answers);
+    answers.append(1, (char)(rdata.size() >> 8));
+    answers.append(1, (char)rdata.size());
+    answers += rdata;
   }
 
-  d_results[""]["finals"] = fmt::format("{}", finals);
+  // the answers rarely change, so only make them readable when they do
+  if(answers != d_lastAnswers || d_lastFinals.empty()) {
+    vector<string> finals;
+    for(const auto& rr : dmv)
+      if(rr.section == DNSSection::Answer && rr.type == d_qtype)
+        finals.push_back(dmv.getName(rr.nameOffset).toString()+" "+dmv.getContent(rr)->toString());
+    d_lastFinals = fmt::format("{}", finals);
+    d_lastAnswers = std::move(answers);
+  }
+  d_results[""]["finals"] = d_lastFinals;
   
   if(matches) {
     return "";
@@ -178,69 +187,69 @@ DNSSOAChecker::DNSSOAChecker(sol::table data) : Checker(data, 2)
   auto serv = data.get<vector<string>>("servers");
   for(const auto& s: serv)
     d_servers.insert(ComboAddress(s, 53));
+  d_query = makeQuery(d_domain, DNSType::SOA, false, false);
 }
 
 CheckResult DNSSOAChecker::perform()
 {
-  map<string, set<string>> harvest;
-  for(const auto& s: d_servers) {
-    DNSMessageWriter dmw(d_domain, DNSType::SOA);
-    
-    dmw.dh.rd = false;
-    dmw.randomizeID();
-    dmw.setEDNS(4000, false);
-    
-    Socket sock(s.sin4.sin_family, SOCK_DGRAM);
-    SConnect(sock, s);
-    
-    SWrite(sock, dmw.serialize());
-
-    ComboAddress server;
+  d_results.clear();
+  // ask everyone at the same time, so this takes as long as the slowest server and not the sum
+  vector<pair<ComboAddress, std::future<DNSEngine::Answer>>> queries;
+  for(const auto& s: d_servers)
+    queries.emplace_back(s, DNSEngine::instance().submit(d_query, s, 0.5));
 
-    double timeo=0.5;
-    if(!waitForData(sock, &timeo)) { // timeout
-      return fmt::format("Timeout asking DNS question for {}|{} to {}",
-                            d_domain.toString(), toString(DNSType::SOA), s.toStringWithPort());
+  CheckResult cr;
+  map<string, set<string>> harvest;
+  for(auto& [s, query] : queries) {
+    string subject = s.toStringWithPort();
+    DNSEngine::Answer answer;
+    try {
+      answer = query.get();
     }
-    string resp = SRecvfrom(sock, 65535, server);
-    
-    DNSMessageReader dmr(resp);
-    
-    DNSSection rrsection;
-    uint32_t ttl;
-    
-    DNSName dn;
-    DNSType dt;
-    dmr.getQuestion(dn, dt);
-    
-    //    cout<<"Received "<<resp.size()<<" byte response with RCode "<<(RCode)dmr.dh.rcode<<", qname " <<dn<<", qtype "<<dt<<endl;
-    
-    if((RCode)dmr.dh.rcode != RCode::Noerror) {
-      return fmt::format("Got DNS response with RCode {} for question {}|{}",
-                            toString((RCode)dmr.dh.rcode), d_domain.toString(), toString(DNSType::SOA));
+    catch(DNSEngine::Timeout&) {
+      cr.d_reasons[subject].push_back(fmt::format("Timeout asking DNS question for {}|{} to {}",
+                                                  d_domain.toString(), toString(DNSType::SOA), subject));
+      continue;
     }
-  
-    std::unique_ptr<RRGen> rr;
+    catch(std::exception& e) { // like failing to send, which should not hide what the other servers said
+      cr.d_reasons[subject].push_back(fmt::format("Error asking DNS question for {}|{} to {}: {}",
+                                                  d_domain.toString(), toString(DNSType::SOA), subject, e.what()));
+      continue;
+    }
+    d_results[subject]["msec"] = answer.msec;
+    d_results[subject]["user-msec"] = answer.userMsec;
+
+    try {
+      DNSMessageView dmv(answer.packet);
+      if((RCode)dmv.dh.rcode != RCode::Noerror) {
+        cr.d_reasons[subject].push_back(fmt::format("Got DNS response with RCode {} from {} for question {}|{}",
+                                                    toString((RCode)dmv.dh.rcode), subject, d_domain.toString(), toString(DNSType::SOA)));
+        continue;
+      }
 
-    int matches = 0;
-    while(dmr.getRR(rrsection, dn, dt, ttl, rr)) {
-      if(dn == d_domain && rrsection == DNSSection::Answer && dt == DNSType::SOA) {
-        harvest[rr->toString()].insert(s.toStringWithPort());
-        matches++;
+      int matches = 0;
+      for(const auto& rr : dmv) {
+        if(rr.section == DNSSection::Answer && rr.type == DNSType::SOA && dmv.nameEquals(rr.nameOffset, d_domain)) {
+          auto content = dmv.getContent(rr);
+          d_results[subject]["serial"] = dynamic_cast<SOAGen*>(content.get())->d_serial;
+          harvest[content->toString()].insert(subject);
+          matches++;
+        }
+      }
+      if(!matches) {
+        cr.d_reasons[subject].push_back(fmt::format("DNS server {} did not return a SOA for {}",
+                                                    subject, d_domain.toString()));
       }
     }
-    if(!matches) {
-      return fmt::format("DNS server {} did not return a SOA for {}",
-                            s.toStringWithPort(), d_domain.toString());
+    catch(std::exception& e) {
+      cr.d_reasons[subject].push_back(fmt::format("Malformed DNS response from {}: {}", subject, e.what()));
     }
   }
-  if(harvest.size() != 1) {
-    return fmt::format("Had different SOA records for {}: {}",
-                       d_domain.toString(), harvest);
+  if(harvest.size() > 1) {
+    cr.d_reasons[""].push_back(fmt::format("Had different SOA records for {}: {}",
+                                           d_domain.toString(), harvest));
   }
-  else {
-    return "";
-  }  
+  return cr;
 }
 
 // minimum of 2 failures
@@ -255,50 +264,32 @@ RRSIGChecker::RRSIGChecker(sol::table data) : Checker(data, 2)
   d_attributes["server"] = d_nsip.toStringWithPort();
   d_attributes["name"] = d_qname.toString();
   d_attributes["type"] = toString(d_qtype);
-
+  d_query = makeQuery(d_qname, d_qtype, false, true);
 }
 
 CheckResult RRSIGChecker::perform()
 {
-  DNSMessageWriter dmw(d_qname, d_qtype);
-          
-  dmw.dh.rd = false;
-  dmw.randomizeID();
-  dmw.setEDNS(4000, true);
-  
-  Socket sock(d_nsip.sin4.sin_family, SOCK_DGRAM);
-  SConnect(sock, d_nsip);
-
-  SWrite(sock, dmw.serialize());
-
-  ComboAddress server;
-
-  double timeo=1.0;
-  if(!waitForData(sock, &timeo)) { // timeout
+  string resp;
+  try {
+    resp = DNSEngine::instance().submit(d_query, d_nsip, 1.0).get().packet;
+  }
+  catch(DNSEngine::Timeout&) {
     return fmt::format("Timeout asking DNS question for {}|{} to {}",
                        d_qname.toString(), toString(d_qtype), d_nsip.toStringWithPort());
   }
-    
-  
-  string resp = SRecvfrom(sock, 65535, server);
   
-  DNSMessageReader dmr(resp);
-  DNSSection rrsection;
-  uint32_t ttl;
-
-  DNSName dn;
-  DNSType dt;
-  dmr.getQuestion(dn, dt);
+  DNSMessageView dmv(resp);
   
-  if((RCode)dmr.dh.rcode != RCode::Noerror) {
+  if((RCode)dmv.dh.rcode != RCode::Noerror) {
     return fmt::format("Got DNS response with RCode {} from {} for question {}|{}",
-                       toString((RCode)dmr.dh.rcode), d_qname.toString(), d_nsip.toStringWithPort(), toString(d_qtype));
+                       toString((RCode)dmv.dh.rcode), d_qname.toString(), d_nsip.toStringWithPort(), toString(d_qtype));
   }
   
-  std::unique_ptr<RRGen> rr;
   bool valid=false;
-  while(dmr.getRR(rrsection, dn, dt, ttl, rr)) {
-    if(rrsection == DNSSection::Answer && dt == DNSType::RRSIG && dn == d_qname) {
+  // with DO set most of the answer is signatures, so only parse the ones we look at
+  for(const auto& rrv : dmv) {
+    if(rrv.section == DNSSection::Answer && rrv.type == DNSType::RRSIG && dmv.nameEquals(rrv.nameOffset, d_qname)) {
+      auto rr = dmv.getContent(rrv);
       auto rrsig = dynamic_cast<RRSIGGen*>(rr.get());
       if(rrsig->d_type != d_qtype) {
         fmt::print("Skipping wrong type {}\n", toString(rrsig->d_type));
@@ -331,3 +322,576 @@ CheckResult RRSIGChecker::perform()
   
   return "";
 }
+
+ZoneFleetChecker::ZoneFleetChecker(sol::table data) : Checker(data, 2)
+{
+  checkLuaTable(data, {"servers", "zones"}, {"minDays", "qps", "dnssec"});
+  for(const auto& s : data.get<vector<string>>("servers"))
+    d_servers.emplace_back(s, 53);
+  if(d_servers.empty())
+    throw std::runtime_error("zonefleet needs at least one server");
+
+  // either a list of zones, or a file with one zone per line
+  vector<string> zones;
+  sol::object zobj = data.get<sol::object>("zones");
+  if(zobj.is<string>()) {
+    string fname = zobj.as<string>();
+    ifstream ifs(fname);
+    if(!ifs)
+      throw std::runtime_error(fmt::format("Could not open zone list '{}': {}", fname, strerror(errno)));
+    string line;
+    while(getline(ifs, line)) {
+      if(auto pos = line.find('#'); pos != string::npos)
+        line.resize(pos);
+      line.erase(0, line.find_first_not_of(" \t\r"));
+      line.erase(line.find_last_not_of(" \t\r") + 1);
+      if(!line.empty())
+        zones.push_back(line);
+    }
+  }
+  else
+    zones = zobj.as<vector<string>>();
+
+  for(const auto& z : zones) {
+    d_zones.push_back(makeDNSName(z));
+    d_queries.push_back(makeQuery(d_zones.back(), DNSType::SOA, false, true));
+  }
+  d_minDays = data.get_or("minDays", d_minDays);
+  d_qps = data.get_or("qps", d_qps);
+  if(d_qps <= 0)
+    throw std::runtime_error("zonefleet qps needs to be positive");
+  d_dnssec = data.get_or("dnssec", d_dnssec);
+
+  vector<string> servers;
+  for(const auto& s : d_servers)
+    servers.push_back(s.toStringWithPort());
+  d_attributes["servers"] = fmt::format("{}", servers);
+  d_attributes["zones"] = (int64_t)d_zones.size();
+  d_attributes["minDays"] = d_minDays;
+  d_attributes["qps"] = d_qps;
+}
+
+/* All queries go through the DNSEngine, paced at d_qps, with at most c_window of them out at the
+   same time. Answers are handled here as they come in, so we never hold more than a window of them */
+CheckResult ZoneFleetChecker::perform()
+{
+  constexpr size_t c_window = 512;
+  struct Done
+  {
+    size_t num;
+    std::exception_ptr e;
+    DNSEngine::Answer answer;
+  };
+  struct Inbox
+  {
+    std::mutex lock;
+    std::condition_variable cv;
+    std::vector<Done> done;
+  };
+  auto inbox = std::make_shared<Inbox>();
+
+  struct ZoneState
+  {
+    std::vector<std::pair<size_t, uint32_t>> serials; // server, serial
+    double maxMsec{0}, maxUserMsec{0};
+    std::optional<time_t> expire; // of the first RRSIG to expire
+  };
+  std::vector<ZoneState> states(d_zones.size());
+
+  d_results.clear();
+  CheckResult cr;
+  const size_t total = d_zones.size() * d_servers.size();
+  size_t sent = 0, received = 0;
+  auto start = std::chrono::steady_clock::now();
+  auto sendTime = [&](size_t num) {
+    return start + std::chrono::microseconds((int64_t)(num * 1000000.0 / d_qps));
+  };
+
+  auto handle = [&](Done& d) {
+    size_t zone = d.num / d_servers.size(), server = d.num % d_servers.size();
+    const string subject = d_zones[zone].toString();
+    const string sname = d_servers[server].toStringWithPort();
+    if(d.e) {
+      try {
+        std::rethrow_exception(d.e);
+      }
+      catch(std::exception& e) {
+        cr.d_reasons[subject].push_back(e.what());
+      }
+      return;
+    }
+    auto& state = states[zone];
+    state.maxMsec = max(state.maxMsec, d.answer.msec);
+    state.maxUserMsec = max(state.maxUserMsec, d.answer.userMsec);
+    try {
+      DNSMessageView dmv(d.answer.packet);
+      if((RCode)dmv.dh.rcode != RCode::Noerror) {
+        cr.d_reasons[subject].push_back(fmt::format("Got DNS response with RCode {} from {} for question {}|SOA",
+                                                    toString((RCode)dmv.dh.rcode), sname, subject));
+        return;
+      }
+      bool haveSOA = false, haveRRSIG = false;
+      for(const auto& rr : dmv) {
+        if(rr.section != DNSSection::Answer || !dmv.nameEquals(rr.nameOffset, d_zones[zone]))
+          continue;
+        if(rr.type == DNSType::SOA) {
+          auto content = dmv.getContent(rr);
+          state.serials.push_back({server, dynamic_cast<SOAGen*>(content.get())->d_serial});
+          haveSOA = true;
+        }
+        else if(rr.type == DNSType::RRSIG) {
+          auto content = dmv.getContent(rr);
+          auto rrsig = dynamic_cast<RRSIGGen*>(content.get());
+          if(rrsig->d_type != DNSType::SOA)
+            continue;
+          haveRRSIG = true;
+          if(!state.expire || *state.expire > (time_t)rrsig->d_expire)
+            state.expire = rrsig->d_expire;
+        }
+      }
+      if(!haveSOA)
+        cr.d_reasons[subject].push_back(fmt::format("DNS server {} did not return a SOA for {}", sname, subject));
+      else if(d_dnssec && !haveRRSIG)
+        cr.d_reasons[subject].push_back(fmt::format("DNS server {} did not return an RRSIG for the SOA of {}", sname, subject));
+    }
+    catch(std::exception& e) {
+      cr.d_reasons[subject].push_back(fmt::format("Malformed DNS response from {} for {}: {}", sname, subject, e.what()));
+    }
+  };
+
+  while(received < total) {
+    auto now = std::chrono::steady_clock::now();
+    while(sent < total && sent - received < c_window && sendTime(sent) <= now) {
+      size_t num = sent++;
+      DNSEngine::instance().submit(d_queries[num / d_servers.size()], d_servers[num % d_servers.size()], 1.0, std::nullopt,
+                                   [inbox, num](std::exception_ptr e, DNSEngine::Answer&& a) {
+        std::lock_guard<std::mutex> l(inbox->lock);
+        inbox->done.push_back({num, e, std::move(a)});
+        inbox->cv.notify_one();
+      });
+    }
+
+    std::vector<Done> done;
+    {
+      std::unique_lock<std::mutex> l(inbox->lock);
+      auto ready = [&]() { return !inbox->done.empty(); };
+      if(sent < total && sent - received < c_window)
+        inbox->cv.wait_until(l, sendTime(sent), ready); // or until we may send the next one
+      else
+        inbox->cv.wait(l, ready); // every query gets an answer or a timeout
+      done.swap(inbox->done);
+    }
+    for(auto& d : done)
+      handle(d);
+    received += done.size();
+  }
+
+  time_t now = time(nullptr);
+  for(size_t zone = 0; zone < d_zones.size(); ++zone) {
+    const auto& state = states[zone];
+    const string subject = d_zones[zone].toString();
+    if(!state.serials.empty()) {
+      auto [lo, hi] = std::minmax_element(state.serials.begin(), state.serials.end(),
+                                          [](const auto& a, const auto& b) { return a.second < b.second; });
+      d_results[subject]["serial"] = hi->second;
+      if(lo->second != hi->second) {
+        map<string, uint32_t> serials;
+        for(const auto& [server, serial] : state.serials)
+          serials[d_servers[server].toStringWithPort()] = serial;
+        cr.d_reasons[subject].push_back(fmt::format("Servers disagree on the SOA serial of {}: {}", subject, serials));
+      }
+      d_results[subject]["msec"] = state.maxMsec;
+      d_results[subject]["user-msec"] = state.maxUserMsec;
+    }
+    if(state.expire) {
+      double days = (*state.expire - now) / 86400.0;
+      d_results[subject]["rrsig-days"] = days;
+      if(now + d_minDays * 86400 > *state.expire)
+        cr.d_reasons[subject].push_back(fmt::format("RRSIG on the SOA of {} expires in {:.0f} days", subject, days));
+    }
+  }
+  return cr;
+}
+
+//! Waits until fd is readable or writable, or throws once deadline has passed
+static void waitForFD(int fd, short events, std::chrono::steady_clock::time_point deadline)
+{
+  for(;;) {
+    auto msec = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+    if(msec <= 0)
+      throw std::runtime_error("Timeout during zone transfer");
+    struct pollfd pfd{fd, events, 0};
+    int res = poll(&pfd, 1, msec);
+    if(res > 0)
+      return;
+    if(res < 0 && errno != EINTR)
+      throw std::runtime_error(fmt::format("Waiting for zone transfer data: {}", strerror(errno)));
+  }
+}
+
+//! Reads exactly len bytes
+static string readTCP(int fd, size_t len, std::chrono::steady_clock::time_point deadline)
+{
+  string ret(len, '\0');
+  size_t pos = 0;
+  while(pos < len) {
+    waitForFD(fd, POLLIN, deadline);
+    auto res = read(fd, &ret.at(pos), len - pos);
+    if(res < 0) {
+      if(errno == EAGAIN || errno == EINTR)
+        continue;
+      throw std::runtime_error(fmt::format("Reading zone transfer: {}", strerror(errno)));
+    }
+    if(!res)
+      throw std::runtime_error("Server closed the connection during zone transfer");
+    pos += res;
+  }
+  return ret;
+}
+
+/* A zone transfer is a stream of DNS messages over TCP, each with a length in front. This sends
+   the query in dmw, and hands every message to f, until f says it has everything */
+static void xfrStream(const ComboAddress& remote, DNSMessageWriter& dmw, double timeout, const std::function<bool(const DNSMessageView&)>& f)
+{
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::microseconds((int64_t)(timeout * 1000000));
+  Socket sock(remote.sin4.sin_family, SOCK_STREAM);
+  SetNonBlocking(sock);
+  SConnectWithTimeout(sock, remote, timeout);
+
+  dmw.randomizeID();
+  string packet = dmw.serialize();
+  string query{(char)(packet.size() >> 8), (char)(packet.size() & 0xff)};
+  query += packet;
+  waitForFD(sock, POLLOUT, deadline);
+  SWrite(sock, query);
+
+  for(;;) {
+    string lenstr = readTCP(sock, 2, deadline);
+    string packet = readTCP(sock, (uint8_t)lenstr[0] << 8 | (uint8_t)lenstr[1], deadline);
+    DNSMessageView dmv(packet);
+    if(dmv.dh.id != dmw.dh.id)
+      throw std::runtime_error(fmt::format("{} of {} from {} got an answer with the wrong ID", toString(dmw.d_qtype),
+                                           dmw.d_qname.toString(), remote.toStringWithPort()));
+    if((RCode)dmv.dh.rcode != RCode::Noerror)
+      throw std::runtime_error(fmt::format("{} of {} from {} failed with RCode {}", toString(dmw.d_qtype),
+                                           dmw.d_qname.toString(), remote.toStringWithPort(), toString((RCode)dmv.dh.rcode)));
+    if(f(dmv))
+      return;
+  }
+}
+
+//! Adds rr to tree, relative to zone, unless it is outside of zone
+static void addXFRRecord(DNSNode& tree, const DNSName& zone, const DNSMessageView& dmv, const DNSMessageView::RRView& rr)
+{
+  DNSName name = dmv.getName(rr.nameOffset);
+  if(!name.makeRelative(zone))
+    return; // not ours, ignore
+  auto node = tree.add(name);
+  node->addRRs(dmv.getContent(rr));
+  if(rr.type != DNSType::RRSIG) // those live with the type they cover
+    node->rrsets[rr.type].ttl = rr.ttl;
+}
+
+//! The first record of an AXFR is the SOA of the zone, and the same SOA at the end says we have everything
+std::unique_ptr<DNSNode> retrieveZone(const ComboAddress& remote, const DNSName& zone, double timeout)
+{
+  DNSMessageWriter dmw(zone, DNSType::AXFR);
+  auto ret = std::make_unique<DNSNode>();
+  int soas = 0;
+  xfrStream(remote, dmw, timeout, [&](const DNSMessageView& dmv) {
+    for(const auto& rr : dmv) {
+      if(rr.section != DNSSection::Answer)
+        continue;
+      if(rr.type == DNSType::SOA && ++soas == 2)
+        return true;
+      if(!soas)
+        throw std::runtime_error(fmt::format("Zone transfer of {} from {} did not start with a SOA", zone.toString(), remote.toStringWithPort()));
+      addXFRRecord(*ret, zone, dmv, rr);
+    }
+    return false;
+  });
+  return ret;
+}
+
+std::unique_ptr<CompactZone> retrieveCompactZone(const ComboAddress& remote, const DNSName& zone, double timeout)
+{
+  DNSMessageWriter dmw(zone, DNSType::AXFR);
+  CompactZone::Builder builder;
+  string rdata;
+  int soas = 0;
+  xfrStream(remote, dmw, timeout, [&](const DNSMessageView& dmv) {
+    for(const auto& rr : dmv) {
+      if(rr.section != DNSSection::Answer)
+        continue;
+      if(rr.type == DNSType::SOA && ++soas == 2)
+        return true;
+      if(!soas)
+        throw std::runtime_error(fmt::format("Zone transfer of {} from {} did not start with a SOA", zone.toString(), remote.toStringWithPort()));
+      DNSName name = dmv.getName(rr.nameOffset);
+      if(!name.makeRelative(zone))
+        continue;
+      dmv.getCanonicalRdata(rr, rdata);
+      builder.add(name, rr.type, rr.ttl, {(const uint8_t*)rdata.data(), rdata.size()});
+    }
+    return false;
+  });
+  return builder.finish();
+}
+
+/* An IXFR answer starts with the newest SOA. If that is all there is, the zone did not change.
+   If the next record is not a SOA, the server sends the whole zone, like with AXFR. Otherwise
+   there is a diff per serial: the old SOA, the records that went away, the new SOA, and the
+   records that got added. The newest SOA once more ends it all (RFC 1995).
+   We only touch tree once we have everything. */
+ZoneDelta updateZone(const ComboAddress& remote, const DNSName& zone, std::unique_ptr<DNSNode>& tree, double timeout)
+{
+  auto& ours = tree->rrsets[DNSType::SOA];
+  if(ours.contents.empty())
+    throw std::runtime_error(fmt::format("No SOA for {} to base an IXFR on", zone.toString()));
+  uint32_t serial = dynamic_cast<SOAGen&>(*ours.contents.front()).d_serial;
+
+  DNSMessageWriter dmw(zone, DNSType::IXFR);
+  dmw.putRR(DNSSection::Authority, zone, ours.ttl, ours.contents.front());
+
+  struct Change
+  {
+    DNSName name;
+    uint32_t ttl;
+    std::unique_ptr<RRGen> rr;
+    bool add;
+  };
+  vector<Change> changes;
+  std::unique_ptr<DNSNode> full;
+  std::unique_ptr<RRGen> newest;
+  uint32_t newestSerial = 0, soaTTL = 0;
+  enum class State { First, Second, Full, Removing, Adding } state = State::First;
+
+  xfrStream(remote, dmw, timeout, [&](const DNSMessageView& dmv) {
+    for(const auto& rr : dmv) {
+      if(rr.section != DNSSection::Answer)
+        continue;
+      if(state == State::First) {
+        if(rr.type != DNSType::SOA)
+          throw std::runtime_error(fmt::format("IXFR of {} from {} did not start with a SOA", zone.toString(), remote.toStringWithPort()));
+        newest = dmv.getContent(rr);
+        newestSerial = dynamic_cast<SOAGen&>(*newest).d_serial;
+        soaTTL = rr.ttl;
+        state = State::Second;
+        continue;
+      }
+      if(state == State::Second) {
+        if(rr.type == DNSType::SOA) { // the old SOA that starts the first diff
+          state = State::Removing;
+          continue;
+        }
+        full = std::make_unique<DNSNode>();
+        state = State::Full;
+      }
+      if(state == State::Full) {
+        if(rr.type == DNSType::SOA)
+          return true;
+        addXFRRecord(*full, zone, dmv, rr);
+        continue;
+      }
+      if(rr.type == DNSType::SOA) {
+        if(state == State::Removing)
+          state = State::Adding;
+        else if(dynamic_cast<SOAGen&>(*dmv.getContent(rr)).d_serial == newestSerial)
+          return true;
+        else
+          state = State::Removing;
+        continue;
+      }
+      DNSName name = dmv.getName(rr.nameOffset);
+      if(name.makeRelative(zone))
+        changes.push_back({name, rr.ttl, dmv.getContent(rr), state == State::Adding});
+    }
+    return state == State::Second; // just the one SOA
+  });
+
+  ZoneDelta ret;
+  if(state == State::Second && newestSerial != serial) // the server wants us to do an AXFR
+    throw std::runtime_error(fmt::format("IXFR of {} from {} only sent a new SOA", zone.toString(), remote.toStringWithPort()));
+  if(full) {
+    ret.full = true;
+    tree = std::move(full);
+  }
+  for(auto& c : changes) {
+    auto node = tree->add(c.name);
+    if(c.add) {
+      if(c.rr->getType() != DNSType::RRSIG)
+        node->rrsets[c.rr->getType()].ttl = c.ttl;
+      node->addRRs(std::move(c.rr));
+      ++ret.added;
+    }
+    else if(node->removeRRs(*c.rr))
+      ++ret.removed;
+    else // our copy is off, tree is now half updated, so it needs a fresh transfer
+      throw std::runtime_error(fmt::format("IXFR of {} from {} removes {} {} which we do not have", zone.toString(), remote.toStringWithPort(),
+                                           (c.name + zone).toString(), c.rr->toString()));
+  }
+  auto& soa = tree->rrsets[DNSType::SOA];
+  soa.contents.clear();
+  soa.contents.push_back(std::move(newest));
+  soa.ttl = soaTTL;
+  return ret;
+}
+
+ZoneSweepChecker::ZoneSweepChecker(sol::table data) : Checker(data, 1)
+{
+  checkLuaTable(data, {"server", "zone"}, {"minDays", "intervalMinutes", "ixfr", "compact"});
+  d_server = ComboAddress(data.get<string>("server"), 53);
+  d_zone = makeDNSName(data.get<string>("zone"));
+  d_minDays = data.get_or("minDays", d_minDays);
+  d_intervalMinutes = data.get_or("intervalMinutes", d_intervalMinutes);
+  d_ixfr = data.get_or("ixfr", d_ixfr);
+  d_compact = data.get_or("compact", d_compact);
+
+  d_attributes["server"] = d_server.toStringWithPort();
+  d_attributes["zone"] = d_zone.toString();
+  d_attributes["minDays"] = d_minDays;
+}
+
+namespace {
+//! Counts RRSIGs, and remembers the few that expire first
+struct RRSIGTally
+{
+  struct Expiry
+  {
+    time_t expire;
+    DNSName name;
+    DNSType type;
+    bool operator<(const Expiry& rhs) const { return expire < rhs.expire; }
+  };
+
+  time_t now;
+  time_t soon; //!< expiring before this is an alert
+  uint64_t total = 0, expiring = 0, premature = 0;
+  std::vector<Expiry> soonest{};
+  static constexpr size_t c_report = 5;
+
+  //! getName only gets called if we want to report this one
+  template<typename F>
+  void add(time_t inception, time_t expire, DNSType type, F getName)
+  {
+    ++total;
+    if(now < inception)
+      ++premature;
+    if(expire < soon)
+      ++expiring;
+    if(soonest.size() < c_report || expire < soonest.back().expire) {
+      Expiry e{expire, getName(), type};
+      soonest.insert(std::upper_bound(soonest.begin(), soonest.end(), e), std::move(e));
+      if(soonest.size() > c_report)
+        soonest.pop_back();
+    }
+  }
+};
+
+void tallyRRSIGs(const DNSNode& node, RRSIGTally& tally)
+{
+  for(const auto& [type, rrset] : node.rrsets) {
+    for(const auto& sig : rrset.signatures) {
+      const auto& rrsig = dynamic_cast<const RRSIGGen&>(*sig);
+      tally.add(rrsig.d_inception, rrsig.d_expire, type, [&]() { return node.getName(); });
+    }
+  }
+  for(const auto& child : node.children)
+    tallyRRSIGs(child, tally);
+}
+
+//! Reads the times straight from the RRSIG record data (RFC 4034 3.1)
+void tallyRRSIGs(const CompactZone& zone, RRSIGTally& tally)
+{
+  auto get32 = [](const uint8_t* p) { return (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3]; };
+  for(const auto& node : zone.nodes()) {
+    for(const auto& rec : zone.records(node)) {
+      if(rec.type != DNSType::RRSIG || rec.rdlen < 18)
+        continue;
+      tally.add(get32(rec.rdata + 12), get32(rec.rdata + 8), (DNSType)(rec.rdata[0] << 8 | rec.rdata[1]),
+                [&]() { return zone.getName(node); });
+    }
+  }
+}
+}
+
+CheckResult ZoneSweepChecker::perform()
+{
+  time_t now = time(nullptr);
+  if(d_lastSweep && now < d_lastSweep + d_intervalMinutes * 60) {
+    d_results.clear(); // the metrics were logged with the sweep they came from
+    return d_lastResult;
+  }
+
+  d_results.clear();
+  auto start = std::chrono::steady_clock::now();
+  ZoneDelta delta;
+  bool incremental = false;
+  if(d_tree && d_ixfr) {
+    try {
+      delta = updateZone(d_server, d_zone, d_tree);
+      incremental = !delta.full;
+    }
+    catch(std::exception&) {
+      d_tree.reset(); // so we do an AXFR
+    }
+  }
+  if(!incremental && !delta.full) {
+    try {
+      if(d_compact)
+        d_compactZone = retrieveCompactZone(d_server, d_zone);
+      else
+        d_tree = retrieveZone(d_server, d_zone);
+    }
+    catch(std::exception& e) {
+      // try again next round
+      d_tree.reset();
+      d_compactZone.reset();
+      return fmt::format("Could not transfer {} from {}: {}", d_zone.toString(), d_server.toStringWithPort(), e.what());
+    }
+  }
+  d_results[""]["transfer-msec"] = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+  d_results[""]["full-transfer"] = (int32_t)!incremental;
+  if(incremental) {
+    double hours = std::max(now - d_lastSweep, (time_t)1) / 3600.0;
+    d_results[""]["added"] = (int64_t)delta.added;
+    d_results[""]["removed"] = (int64_t)delta.removed;
+    d_results[""]["added-per-hour"] = delta.added / hours;
+    d_results[""]["removed-per-hour"] = delta.removed / hours;
+  }
+
+  RRSIGTally tally{now, now + d_minDays * 86400};
+  if(d_compactZone) {
+    tallyRRSIGs(*d_compactZone, tally);
+    d_results[""]["records"] = (int64_t)d_compactZone->size();
+    d_results[""]["memory-kb"] = (int64_t)(d_compactZone->memoryUsage() / 1024);
+  }
+  else
+    tallyRRSIGs(*d_tree, tally);
+
+  d_results[""]["rrsigs"] = (int64_t)tally.total;
+  d_results[""]["expiring"] = (int64_t)tally.expiring;
+  d_results[""]["premature"] = (int64_t)tally.premature;
+  if(!tally.soonest.empty())
+    d_results[""]["soonest-days"] = (tally.soonest.front().expire - now) / 86400.0;
+
+  CheckResult cr;
+  if(!tally.total)
+    cr = fmt::format("Zone {} from {} has no RRSIGs", d_zone.toString(), d_server.toStringWithPort());
+  else if(tally.expiring) {
+    vector<string> where;
+    for(const auto& e : tally.soonest) {
+      if(e.expire >= tally.soon)
+        break;
+      where.push_back(fmt::format("{}|{} in {:.1f} days", (e.name + d_zone).toString(), toString(e.type), (e.expire - now) / 86400.0));
+    }
+    cr = fmt::format("{} of {} RRSIGs in {} from {} expire within {} days, soonest: {}", tally.expiring, tally.total,
+                     d_zone.toString(), d_server.toStringWithPort(), d_minDays, fmt::join(where, ", "));
+  }
+  if(tally.premature)
+    cr.d_reasons[""].push_back(fmt::format("{} RRSIGs in {} from {} are not yet valid", tally.premature, d_zone.toString(), d_server.toStringWithPort()));
+
+  d_lastSweep = now;
+  d_lastResult = cr;
+  return cr;
+}
@@ -0,0 +1,75 @@
+#include "kerneltime.hh"
+#include <cerrno>
+#include <cstring>
+#include <linux/errqueue.h>
+#include <linux/net_tstamp.h>
+#include <netinet/in.h>
+
+bool enableKernelTimestamps(int fd)
+{
+  // OPT_ID numbers the send timestamps, OPT_TSONLY saves the kernel from sending the packet back
+  int flags = SOF_TIMESTAMPING_TX_SOFTWARE | SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE |
+    SOF_TIMESTAMPING_OPT_ID | SOF_TIMESTAMPING_OPT_TSONLY;
+  return setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags)) == 0;
+}
+
+//! The software timestamp is the first of three
+static bool getTimestamp(const struct msghdr& msgh, struct timespec& ts)
+{
+  for(auto cmsg = CMSG_FIRSTHDR(&msgh); cmsg; cmsg = CMSG_NXTHDR((struct msghdr*)&msgh, cmsg)) {
+    if(cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPING &&
+       cmsg->cmsg_len >= CMSG_LEN(sizeof(struct scm_timestamping))) {
+      struct scm_timestamping tss;
+      memcpy(&tss, CMSG_DATA(cmsg), sizeof(tss));
+      if(!tss.ts[0].tv_sec && !tss.ts[0].tv_nsec)
+        return false;
+      ts = tss.ts[0];
+      return true;
+    }
+  }
+  return false;
+}
+
+bool getRXTimestamp(const struct msghdr& msgh, struct timespec& ts)
+{
+  return getTimestamp(msgh, ts);
+}
+
+bool getTXTimestamp(const struct msghdr& msgh, uint32_t& id, struct timespec& ts)
+{
+  bool haveID = false;
+  for(auto cmsg = CMSG_FIRSTHDR(&msgh); cmsg; cmsg = CMSG_NXTHDR((struct msghdr*)&msgh, cmsg)) {
+    if((cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) ||
+       (cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR)) {
+      struct sock_extended_err see;
+      memcpy(&see, CMSG_DATA(cmsg), sizeof(see));
+      if(see.ee_errno == ENOMSG && see.ee_origin == SO_EE_ORIGIN_TIMESTAMPING) {
+        id = see.ee_data;
+        haveID = true;
+      }
+    }
+  }
+  return haveID && getTimestamp(msgh, ts);
+}
+
+bool readTXTimestamp(int fd, uint32_t& id, struct timespec& ts)
+{
+  for(;;) {
+    char data[256];
+    union {
+      struct cmsghdr align;
+      char buf[512];
+    } cbuf;
+    struct iovec iov{data, sizeof(data)};
+    struct msghdr msgh;
+    memset(&msgh, 0, sizeof(msgh));
+    msgh.msg_iov = &iov;
+    msgh.msg_iovlen = 1;
+    msgh.msg_control = cbuf.buf;
+    msgh.msg_controllen = sizeof(cbuf.buf);
+    if(recvmsg(fd, &msgh, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+      return false;
+    if(getTXTimestamp(msgh, id, ts))
+      return true;
+  }
+}
@@ -0,0 +1,37 @@
+#pragma once
+#include <cstdint>
+#include <sys/socket.h>
+#include <time.h>
+
+/*!
+  @file
+  @brief Kernel software timestamps for the packets we send and receive
+
+  A round trip time measured in user space also counts the time until our thread got to run,
+  and under load that is what our graphs end up showing. With SO_TIMESTAMPING the kernel notes
+  when a packet left and when the answer came in. Receive timestamps come with the packet, in a
+  control message. Send timestamps come back later on the error queue of the socket, numbered
+  in the order the packets were sent.
+
+  All timestamps are CLOCK_REALTIME.
+*/
+
+//! Asks the kernel to timestamp what fd sends and receives. Returns false if it won't
+bool enableKernelTimestamps(int fd);
+
+//! Finds the receive timestamp in the control messages from recvmsg on such an fd
+bool getRXTimestamp(const struct msghdr& msgh, struct timespec& ts);
+
+//! Finds the send timestamp and its id in the control messages from recvmsg(MSG_ERRQUEUE) on such an fd
+bool getTXTimestamp(const struct msghdr& msgh, uint32_t& id, struct timespec& ts);
+
+/*! Reads one send timestamp from the error queue of fd. id is the number of the packet, counting
+    from 0 for the first packet sent after enableKernelTimestamps(). Returns false if there are
+    no more timestamps. Anything else on the error queue gets skipped. */
+bool readTXTimestamp(int fd, uint32_t& id, struct timespec& ts);
+
+//! Milliseconds from from to to
+inline double msecBetween(const struct timespec& from, const struct timespec& to)
+{
+  return (to.tv_sec - from.tv_sec) * 1000.0 + (to.tv_nsec - from.tv_nsec) / 1000000.0;
+}
@@ -97,6 +97,12 @@ void initLua()
   g_lua.set_function("dnssoa", [&](sol::table data) {
     g_checkers.emplace_back(make_unique<DNSSOAChecker>(data));
   });
+  g_lua.set_function("zonefleet", [&](sol::table data) {
+    g_checkers.emplace_back(make_unique<ZoneFleetChecker>(data));
+  });
+  g_lua.set_function("zonesweep", [&](sol::table data) {
+    g_checkers.emplace_back(make_unique<ZoneSweepChecker>(data));
+  });
   g_lua.set_function("tcpportclosed", [&](sol::table data) {
     g_checkers.emplace_back(make_unique<TCPPortClosedChecker>(data));
   });
@@ -118,6 +124,9 @@ void initLua()
   g_lua.set_function("ping", [&](sol::table data) {
     g_checkers.emplace_back(make_unique<PINGChecker>(data));
   });
+  g_lua.set_function("traceroute", [&](sol::table data) {
+    g_checkers.emplace_back(make_unique<TraceRouteChecker>(data));
+  });
   
   g_lua.set_function("prometheusExp", [&](sol::table data) {
     g_checkers.emplace_back(make_unique<PrometheusChecker>(data));
@@ -4,6 +4,7 @@
 #include <openssl/x509v3.h>
 #include "peglib.h"
 #include "nonblocker.hh"
+#include "certcache.hh"
 #include <mutex>
 
 using namespace std;
@@ -132,18 +133,15 @@ void SSLHelper::checkConnection(const std::string& host, int minCertDays)
     throw std::runtime_error(fmt::format("Certificate verification error: {}\n", X509_verify_cert_error_string(verify_result)));
   }
   
-  shared_ptr<X509> cert(SSL_get_peer_certificate(ssl), X509_free);
-  // this is sensitive to trailing dots
-  if (X509_check_host(cert.get(), host.c_str(), host.size(), 0, NULL) != 1) {
+  auto certs = g_certcache.lookup(ssl, host);
+  if(certs.chain.empty())
+    throw std::runtime_error(fmt::format("No certificate for host {}", host));
+  if(!certs.hostOK) {
     throw std::runtime_error(fmt::format("Cert does not match host {}", host));
   }
 
   if(minCertDays > 0) {
-    auto t=X509_get_notAfter(cert.get());
-    struct tm notafter;
-    ASN1_TIME_to_tm(t, &notafter);
-    time_t expire = mktime(&notafter);
-    double days = (expire - time(nullptr))/86400.0;
+    double days = (certs.chain.front().notAfter - time(nullptr))/86400.0;
     if(days < minCertDays)
       throw std::runtime_error(
                                fmt::format("Certificate for {} set to expire in {:.0f} days",
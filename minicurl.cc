@@ -26,8 +26,89 @@
 #include <curl/curl.h>
 #include <stdexcept>
 #include <vector>
+#include <mutex>
 #include "fmt/format.h"
 #include "fmt/printf.h"
+#include <openssl/ssl.h>
+#include <strings.h>
+
+namespace {
+//! A CURLSH plus the locks libcurl needs to use it from our worker threads
+struct MiniCurlShare
+{
+  explicit MiniCurlShare(bool withDNS)
+  {
+    d_share = curl_share_init();
+    if (d_share == nullptr) {
+      throw std::runtime_error("Error creating a MiniCurl share");
+    }
+    curl_share_setopt(d_share, CURLSHOPT_LOCKFUNC, lockFunc);
+    curl_share_setopt(d_share, CURLSHOPT_UNLOCKFUNC, unlockFunc);
+    curl_share_setopt(d_share, CURLSHOPT_USERDATA, this);
+    curl_share_setopt(d_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+    if(withDNS)
+      curl_share_setopt(d_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+  }
+  static void lockFunc(CURL*, curl_lock_data data, curl_lock_access, void* userptr)
+  {
+    static_cast<MiniCurlShare*>(userptr)->d_locks[data].lock();
+  }
+  static void unlockFunc(CURL*, curl_lock_data data, void* userptr)
+  {
+    static_cast<MiniCurlShare*>(userptr)->d_locks[data].unlock();
+  }
+  CURLSH* d_share;
+  std::mutex d_locks[CURL_LOCK_DATA_LAST];
+};
+
+// CURLOPT_RESOLVE entries land in the DNS cache, so transfers to a pinned address only share TLS sessions
+CURLSH* getShare(bool withDNS)
+{
+  static MiniCurlShare s_all(true), s_sessions(false);
+  return withDNS ? s_all.d_share : s_sessions.d_share;
+}
+
+/* libcurl does not support sharing its connection cache between concurrent threads.
+   Instead, an easy handle keeps its own connections, and we hand it to the next transfer
+   that goes to the same place. */
+struct PooledHandle
+{
+  CURL* curl;
+  MiniCurl::certinfo_t certinfo;
+  time_t lastUsed;
+};
+
+std::mutex s_poolLock;
+std::map<std::string, std::vector<PooledHandle>> s_pool; //!< newest at the back
+size_t s_pooled = 0; //!< handles in s_pool
+constexpr size_t c_maxPooledPerKey = 4;
+constexpr size_t c_maxPooled = 64;
+constexpr time_t c_maxIdle = 300; //!< a few check intervals, servers close idle connections anyway
+
+/* Takes the handles that were not used for c_maxIdle out of the pool, and drops keys without
+   handles. Keys come and go with the IP addresses of a name, so this also stops those piling up.
+   Call with s_poolLock held, and clean up what comes back without it */
+std::vector<CURL*> pruneIdle(time_t now)
+{
+  std::vector<CURL*> ret;
+  for(auto iter = s_pool.begin(); iter != s_pool.end();) {
+    auto& handles = iter->second;
+    std::erase_if(handles, [&](const auto& h) {
+      if(now - h.lastUsed <= c_maxIdle)
+        return false;
+      ret.push_back(h.curl);
+      return true;
+    });
+    if(handles.empty())
+      iter = s_pool.erase(iter);
+    else
+      ++iter;
+  }
+  s_pooled -= ret.size();
+  return ret;
+}
+}
+
 void MiniCurl::init()
 {
   static std::atomic_flag s_init = ATOMIC_FLAG_INIT;
@@ -41,8 +122,12 @@ void MiniCurl::init()
   }
 }
 
-MiniCurl::MiniCurl(const string& useragent)
+MiniCurl::MiniCurl(const string& useragent, bool reuse) : d_useragent(useragent), d_reuse(reuse)
 {
+  if(d_reuse) {
+    d_curl = nullptr; // taken from the pool once setupURL knows where we are going
+    return;
+  }
   d_curl = curl_easy_init();
   if (d_curl == nullptr) {
     throw std::runtime_error("Error creating a MiniCurl session");
@@ -54,16 +139,116 @@ MiniCurl::~MiniCurl()
 {
   if(d_host_list)
     curl_slist_free_all(d_host_list);
-  curl_easy_cleanup(d_curl);
+  if(d_reuse)
+    releaseHandle();
+  else
+    curl_easy_cleanup(d_curl);
+}
+
+void MiniCurl::acquireHandle(const std::string& key, bool pinned)
+{
+  if(d_curl && key == d_poolKey)
+    return;
+  releaseHandle();
+  d_poolKey = key;
+  std::vector<CURL*> idle;
+  {
+    std::lock_guard<std::mutex> l(s_poolLock);
+    idle = pruneIdle(time(nullptr));
+    if(auto iter = s_pool.find(key); iter != s_pool.end()) {
+      auto& handles = iter->second;
+      d_curl = handles.back().curl;
+      d_lastCertinfo = std::move(handles.back().certinfo);
+      handles.pop_back();
+      --s_pooled;
+      if(handles.empty())
+        s_pool.erase(iter);
+    }
+  }
+  for(auto* c : idle)
+    curl_easy_cleanup(c);
+  if(d_curl)
+    curl_easy_reset(d_curl); // clears options, keeps the connections
+  else if((d_curl = curl_easy_init()) == nullptr)
+    throw std::runtime_error("Error creating a MiniCurl session");
+
+  curl_easy_setopt(d_curl, CURLOPT_USERAGENT, d_useragent.c_str());
+  curl_easy_setopt(d_curl, CURLOPT_SHARE, getShare(!pinned));
+}
+
+void MiniCurl::releaseHandle()
+{
+  if(!d_curl)
+    return;
+  std::vector<CURL*> idle;
+  {
+    std::lock_guard<std::mutex> l(s_poolLock);
+    time_t now = time(nullptr);
+    idle = pruneIdle(now);
+    auto& handles = s_pool[d_poolKey];
+    if(handles.size() < c_maxPooledPerKey && s_pooled < c_maxPooled) {
+      handles.push_back({d_curl, std::move(d_lastCertinfo), now});
+      ++s_pooled;
+      d_curl = nullptr;
+    }
+    else if(handles.empty())
+      s_pool.erase(d_poolKey);
+  }
+  for(auto* c : idle)
+    curl_easy_cleanup(c);
+  if(d_curl)
+    curl_easy_cleanup(d_curl);
+  d_curl = nullptr;
+  d_lastCertinfo.clear();
 }
 
 size_t MiniCurl::write_callback(char *ptr, size_t size, size_t nmemb, void *userdata)
 {
   MiniCurl* us = (MiniCurl*)userdata;
+  if(us->d_bodyFunc) {
+    if(!us->d_bodyFunc(std::string_view(ptr, size*nmemb))) {
+      us->d_stopped = true;
+      return 0; // makes curl abort the transfer
+    }
+    return size*nmemb;
+  }
   us->d_data.append(ptr, size*nmemb);
   return size*nmemb;
 }
 
+/* Called for every header line of every response, including those we get redirected from.
+   The TLS session is only ours while the transfer is running, so this is where we look at it. */
+size_t MiniCurl::header_callback(char *ptr, size_t size, size_t nmemb, void *userdata)
+{
+  MiniCurl* us = (MiniCurl*)userdata;
+  std::string_view line(ptr, size*nmemb);
+  if(line.size() > 5 && strncasecmp(line.data(), "etag:", 5) == 0) {
+    auto etag = line.substr(5);
+    while(!etag.empty() && isspace(etag.front()))
+      etag.remove_prefix(1);
+    while(!etag.empty() && isspace(etag.back()))
+      etag.remove_suffix(1);
+    us->d_etag = etag;
+    return size*nmemb;
+  }
+  if(line.substr(0, 5) != "HTTP/") // status line, once per response
+    return size*nmemb;
+
+  us->d_etag.clear();
+  if(!us->d_certinfo)
+    return size*nmemb;
+  us->d_certinfo->clear();
+  const struct curl_tlssessioninfo* info = nullptr;
+  if(curl_easy_getinfo(us->d_curl, CURLINFO_TLS_SSL_PTR, &info) != CURLE_OK || !info ||
+     info->backend != CURLSSLBACKEND_OPENSSL || !info->internals)
+    return size*nmemb; // plain http
+
+  // a resumed session may only know the leaf, see CertCache::lookup
+  us->d_resumed = SSL_session_reused((SSL*)info->internals);
+  *us->d_certinfo = g_certcache.lookup((SSL*)info->internals).chain;
+  return size*nmemb;
+}
+
 using namespace std;
 
 string extractHostFromURL(const std::string& url)
@@ -81,6 +266,10 @@ string extractHostFromURL(const std::string& url)
 
 void MiniCurl::setupURL(const std::string& str, const ComboAddress* rem, const ComboAddress* src)
 {
+  if(d_reuse)
+    acquireHandle(fmt::format("{}|{}|{}", extractHostFromURL(str),
+                              rem ? rem->toStringWithPort() : "", src ? src->toString() : ""),
+                  rem != nullptr);
   if(rem) {
     if(d_host_list) {
       curl_slist_free_all(d_host_list);
@@ -120,7 +309,8 @@ void MiniCurl::setupURL(const std::string& str, const ComboAddress* rem, const C
   curl_easy_setopt(d_curl, CURLOPT_WRITEFUNCTION, write_callback);
   curl_easy_setopt(d_curl, CURLOPT_WRITEDATA, this);
   curl_easy_setopt(d_curl, CURLOPT_TIMEOUT, 10L);
-  curl_easy_setopt(d_curl, CURLOPT_CERTINFO, 1L);
+  curl_easy_setopt(d_curl, CURLOPT_HEADERFUNCTION, header_callback);
+  curl_easy_setopt(d_curl, CURLOPT_HEADERDATA, this);
   curl_easy_setopt(d_curl, CURLOPT_FILETIME, 1L);
   if(src) {
     curl_easy_setopt(d_curl, CURLOPT_INTERFACE, src->toString().c_str());
@@ -138,35 +328,52 @@ std::string MiniCurl::getURL(const std::string& str, const bool nobody, MiniCurl
   setupURL(str, rem, src);
   if (nobody)
     curl_easy_setopt(d_curl, CURLOPT_NOBODY, 1L);
+  if(!d_ifNoneMatch.empty())
+    setHeaders({{"If-None-Match", d_ifNoneMatch}});
+  if(d_ifModifiedSince > 0) {
+    curl_easy_setopt(d_curl, CURLOPT_TIMECONDITION, (long)CURL_TIMECOND_IFMODSINCE);
+    curl_easy_setopt(d_curl, CURLOPT_TIMEVALUE_LARGE, (curl_off_t)d_ifModifiedSince);
+  }
+  d_etag.clear();
+  d_numConnects = -1;
+  d_resumed = false;
+  d_stopped = false;
+  if(ciptr)
+    ciptr->clear();
+  d_certinfo = ciptr;
   auto res = curl_easy_perform(d_curl);
+  d_certinfo = nullptr;
   if(d_host_list) {
     curl_slist_free_all(d_host_list);
     d_host_list = nullptr;
   }
+  if(res == CURLE_WRITE_ERROR && d_stopped)
+    res = CURLE_OK; // we asked for this
   if(res != CURLE_OK)  {
     throw std::runtime_error("Unable to retrieve URL "+str+ " - "+string(curl_easy_strerror(res)));
   }
 
   d_filetime=-1;
   curl_easy_getinfo(d_curl, CURLINFO_FILETIME, &d_filetime);
-  
-  if(ciptr) {
-    struct curl_certinfo *ci;
-    res = curl_easy_getinfo(d_curl, CURLINFO_CERTINFO, &ci);
-    if(res) {
-      throw std::runtime_error(fmt::format("URL: {}, Error: {}\n", str, curl_easy_strerror(res)));
-    }
+  curl_easy_getinfo(d_curl, CURLINFO_NUM_CONNECTS, &d_numConnects);
 
-    int i;
-    for(i = 0; i < ci->num_of_certs; i++) {
-      struct curl_slist *slist;
-      
-      for(slist = ci->certinfo[i]; slist; slist = slist->next) {
-        string data = slist->data;
-        if(auto pos = data.find(':'); pos != string::npos)
-          (*ciptr)[i][data.substr(0, pos)] = data.substr(pos+1);
-      }
-    }
+  d_timings = Timings();
+  curl_easy_getinfo(d_curl, CURLINFO_NAMELOOKUP_TIME_T, &d_timings.namelookup);
+  curl_easy_getinfo(d_curl, CURLINFO_CONNECT_TIME_T, &d_timings.connect);
+  curl_easy_getinfo(d_curl, CURLINFO_APPCONNECT_TIME_T, &d_timings.appconnect);
+  curl_easy_getinfo(d_curl, CURLINFO_PRETRANSFER_TIME_T, &d_timings.pretransfer);
+  curl_easy_getinfo(d_curl, CURLINFO_STARTTRANSFER_TIME_T, &d_timings.starttransfer);
+  curl_easy_getinfo(d_curl, CURLINFO_TOTAL_TIME_T, &d_timings.total);
+  curl_easy_getinfo(d_curl, CURLINFO_REDIRECT_TIME_T, &d_timings.redirect);
+  curl_easy_getinfo(d_curl, CURLINFO_SPEED_DOWNLOAD_T, &d_timings.downloadSpeed);
+  
+  if(ciptr && d_reuse) {
+    /* Without a TLS session we still know the certificates seen when the connection was set up.
+       A new connection that resumed a shared session is to the same place, so that goes too */
+    if(ciptr->empty() && (d_numConnects == 0 || d_resumed))
+      *ciptr = d_lastCertinfo;
+    else
+      d_lastCertinfo = *ciptr;
   }
   d_http_code = 0;  
   curl_easy_getinfo(d_curl, CURLINFO_RESPONSE_CODE, &d_http_code);
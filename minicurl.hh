@@ -26,8 +26,12 @@
 #include <string>
 #include <curl/curl.h>
 #include "comboaddress.hh"
+#include "certcache.hh"
 #include <map>
+#include <vector>
 #include <atomic>
+#include <functional>
+#include <string_view>
 #include <stdexcept>
 using std::string;
 // turns out 'CURL' is currently typedef for void which means we can't easily forward declare it
@@ -39,10 +43,11 @@ public:
 
   static void init();
 
-  MiniCurl(const string& useragent="MiniCurl/0.0");
+  //! With reuse set, the CURL handle comes from a pool and shares DNS and TLS session caches
+  MiniCurl(const string& useragent="MiniCurl/0.0", bool reuse=false);
   ~MiniCurl();
   MiniCurl& operator=(const MiniCurl&) = delete;
-  typedef std::map<int, std::map<std::string, std::string>> certinfo_t;
+  typedef std::vector<CertValidity> certinfo_t; //!< the peer chain, leaf first
   std::string getURL(const std::string& str, const bool nobody=0, certinfo_t* ciptr=0, const ComboAddress* rem=0, const ComboAddress* src=0);
   std::string postURL(const std::string& str, const std::string& postdata, MiniCurlHeaders& headers);
 
@@ -50,9 +55,37 @@ public:
   CURL *d_curl;
   time_t d_filetime=-1;
   long d_http_code=-1;
+  long d_numConnects=-1; //!< new connections the last transfer needed, 0 means it reused one
+
+  //! Where the last transfer spent its time, in microseconds since it started, as measured by curl
+  struct Timings
+  {
+    curl_off_t namelookup=0, connect=0, appconnect=0, pretransfer=0, starttransfer=0, total=0;
+    curl_off_t redirect=0;      //!< time spent on all redirection steps before the final one
+    curl_off_t downloadSpeed=0; //!< average, in bytes/second
+  };
+  Timings d_timings;
+
+  //! If set, gets the body as it arrives instead of getURL returning it. Return false to stop the transfer
+  std::function<bool(std::string_view)> d_bodyFunc;
+  bool d_stopped=false; //!< d_bodyFunc stopped the last transfer early
+
+  //! Makes the next getURL conditional, a 304 status then means nothing changed
+  std::string d_ifNoneMatch;
+  time_t d_ifModifiedSince=-1;
+  std::string d_etag; //!< of the last response, empty if it did not have one
 private:
   std::string d_data;
+  std::string d_useragent;
+  bool d_reuse=false;
+  std::string d_poolKey;
+  certinfo_t d_lastCertinfo; //!< travels with a pooled handle, for transfers over a reused connection
+  void acquireHandle(const std::string& key, bool pinned);
+  void releaseHandle();
   static size_t write_callback(char *ptr, size_t size, size_t nmemb, void *userdata);
+  static size_t header_callback(char *ptr, size_t size, size_t nmemb, void *userdata);
+  certinfo_t* d_certinfo = nullptr; //!< filled from the TLS session during the transfer, if set
+  bool d_resumed = false; //!< the last transfer resumed a shared TLS session
 
   struct curl_slist* d_header_list = nullptr;
   struct curl_slist *d_host_list = nullptr;
@@ -1,5 +1,7 @@
 #include "sclasses.hh"
 #include <thread>
+#include <future>
+#include <numeric>
 #include <signal.h>
 #include "fmt/format.h"
 #include "fmt/ranges.h"
@@ -7,10 +9,12 @@
 #include "minicurl.hh"
 #include "httplib.h"
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <netinet/ip_icmp.h>
 #include <netinet/ip6.h>
 #include <netinet/icmp6.h>
 #include "support.hh"
+#include "pingengine.hh"
 
 using namespace std;
 
@@ -25,6 +29,12 @@ TCPPortClosedChecker::TCPPortClosedChecker(sol::table data) : Checker(data)
   }
 }
 
+double roundDec(double val, int dec)
+{
+  double fact = pow(10, dec);
+  return ((int)(fact*val))/fact;
+}
+
 CheckResult TCPPortClosedChecker::perform()
 {
   CheckResult cr;
@@ -75,7 +85,7 @@ TCPPortOpenChecker::TCPPortOpenChecker(sol::table data) : Checker(data)
 CheckResult TCPPortOpenChecker::perform()
 {
   CheckResult cr;
-  
+  d_results.clear();
   for(const auto& s : d_servers) {
     for(const auto& p : d_ports) {
       int ret=-1;
@@ -86,7 +96,17 @@ CheckResult TCPPortOpenChecker::perform()
         Socket sock(s.sin4.sin_family, SOCK_STREAM);
         SetNonBlocking(sock);
         //fmt::print("Going to connect to {}\n", rem.toStringWithPort());
+        auto start = std::chrono::steady_clock::now();
         ret = SConnectWithTimeout(sock, rem, 1);
+        if(ret >= 0) {
+          auto& results = d_results[rem.toStringWithPort()];
+          results["user-msec"] = roundDec(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count(), 2);
+          // the kernel timed the SYN to SYN-ACK round trip, without our scheduling delay
+          struct tcp_info ti;
+          socklen_t len = sizeof(ti);
+          if(getsockopt(sock, IPPROTO_TCP, TCP_INFO, &ti, &len) == 0 && ti.tcpi_rtt)
+            results["msec"] = roundDec(ti.tcpi_rtt / 1000.0, 2);
+        }
       }
       catch(exception& e) {
         //        fmt::print("Could not connnect to TCP {}: {}\n",
@@ -115,7 +135,7 @@ CheckResult TCPPortOpenChecker::perform()
 // XXX needs switch to select IPv4 or IPv6 or happy eyeballs?
 HTTPSChecker::HTTPSChecker(sol::table data) : Checker(data)
 {
-  checkLuaTable(data, {"url"}, {"maxAgeMinutes", "minBytes", "minCertDays", "serverIP", "method", "localIP4", "localIP6", "dns", "regex"});
+  checkLuaTable(data, {"url"}, {"maxAgeMinutes", "minBytes", "minCertDays", "serverIP", "method", "localIP4", "localIP6", "dns", "regex", "reuse", "maxBytes"});
   d_url = data.get<string>("url");
   d_maxAgeMinutes =data.get_or("maxAgeMinutes", 0);
   d_minCertDays =  data.get_or("minCertDays", 14);
@@ -124,12 +144,16 @@ HTTPSChecker::HTTPSChecker(sol::table data) : Checker(data)
   string localip6= data.get_or("localIP6", string(""));
   
   d_minBytes =     data.get_or("minBytes", 0);
+  d_maxBytes =     data.get_or("maxBytes", 0);
   d_method =       data.get_or("method", string("GET"));
   vector<string> dns = data.get_or("dns", vector<string>());
   d_regexStr =     data.get_or("regex", string(""));
+  d_reuse =        data.get_or("reuse", false);
 
   d_attributes["url"] = d_url;
   d_attributes["method"] = d_method;
+  if(d_reuse)
+    d_attributes["reuse"] = d_reuse;
 
   if(!serverip.empty()) {
     d_serverIP = ComboAddress(serverip, 443);
@@ -157,13 +181,92 @@ HTTPSChecker::HTTPSChecker(sol::table data) : Checker(data)
     throw runtime_error(fmt::format("only support HTTP HEAD & GET methods, not '{}'", d_method));
   if(!d_regexStr.empty())
     d_attributes["regex"] = d_regexStr;
+  if(d_maxBytes)
+    d_attributes["maxBytes"] = (int64_t)d_maxBytes;
   d_regex = std::regex(d_regexStr);
+  if(!d_regexStr.empty()) {
+    try {
+      d_sregex.emplace(d_regexStr);
+    }
+    catch(StreamRegex::Unsupported&) {
+      // we fall back to std::regex, which needs the body
+      d_attributes["regex-engine"] = "std::regex";
+    }
+  }
+  // lookaheads and \B can peek past the end of what we have received so far
+  d_regexLineLocal = d_regexStr.find("(?") == string::npos && d_regexStr.find("\\B") == string::npos;
 }
 
-double roundDec(double val, int dec)
+namespace {
+//! Checks a response body while it comes in, so the transfer can stop once we have seen enough
+class BodyInspector
 {
-  double fact = pow(10, dec);
-  return ((int)(fact*val))/fact;
+public:
+  BodyInspector(size_t minBytes, size_t maxBytes, const StreamRegex* sregex, const std::regex* regex, bool lineLocal) :
+    d_minBytes(minBytes), d_maxBytes(maxBytes), d_regex(sregex ? nullptr : regex), d_lineLocal(lineLocal)
+  {
+    if(sregex)
+      d_search.emplace(*sregex);
+  }
+
+  //! Feed the next chunk, returns false if the transfer can stop
+  bool operator()(std::string_view chunk)
+  {
+    if(d_maxBytes && d_bytes + chunk.size() > d_maxBytes) {
+      chunk = chunk.substr(0, d_maxBytes - d_bytes);
+      d_truncated = true;
+    }
+    d_bytes += chunk.size();
+    if(d_search)
+      d_matched = d_search->feed(chunk);
+    else if(d_regex && !d_matched) {
+      d_body.append(chunk);
+      // matches that don't span a newline can be found early, finish() catches the rest
+      auto pos = d_body.rfind('\n');
+      if(d_lineLocal && pos != string::npos && pos >= d_searchFrom) {
+        auto flags = std::regex_constants::match_not_eol | std::regex_constants::match_not_eow;
+        if(d_searchFrom)
+          flags |= std::regex_constants::match_prev_avail;
+        d_matched = std::regex_search(d_body.cbegin() + d_searchFrom, d_body.cbegin() + pos + 1, *d_regex, flags);
+        d_searchFrom = pos + 1;
+      }
+      if(d_matched)
+        string().swap(d_body);
+    }
+    return !d_truncated && !satisfied();
+  }
+
+  //! Call once the transfer is done, searches what could not be searched incrementally
+  void finish()
+  {
+    if(d_search)
+      d_matched = d_search->finish();
+    else if(d_regex && !d_matched)
+      d_matched = std::regex_search(d_body, *d_regex);
+    string().swap(d_body);
+  }
+
+  size_t d_bytes = 0;
+  bool d_matched = false;
+  bool d_truncated = false; //!< the body went beyond maxBytes
+
+private:
+  //! There is nothing left to learn from the rest of the body
+  bool satisfied() const
+  {
+    if(!d_minBytes && !d_regex && !d_search) // nothing to check, so we measure the whole body
+      return false;
+    if(d_search && !d_matched && !d_search->dead())
+      return false;
+    return d_bytes >= d_minBytes && (d_search || !d_regex || d_matched);
+  }
+  size_t d_minBytes, d_maxBytes;
+  std::optional<StreamRegex::Search> d_search; //!< linear time and keeps no body
+  const std::regex* d_regex; //!< the fallback for what StreamRegex does not support
+  bool d_lineLocal;
+  string d_body;          //!< only kept while we still need to search it
+  size_t d_searchFrom = 0; //!< the rest of the body has no match that fits within a line
+};
 }
 
 /*
@@ -173,84 +276,69 @@ from http://blah to https://www.blah/
 CheckResult HTTPSChecker::perform()
 {
   d_results.clear();
-  string serverIP;
-  ComboAddress activeServerIP4, activeServerIP6;
-  activeServerIP4.sin4.sin_family = 0; // "unset"
-  activeServerIP6.sin4.sin_family = 0; // "unset"
-  double dnsMsec4 = 0, dnsMsec6 = 0;
-
   DNSName qname = makeDNSName(extractHostFromURL(d_url));
-  
-  vector<ComboAddress> aaaas;
-  if(*g_haveIPv6) {
-    aaaas=DNSResolveAt(qname, DNSType::AAAA, getResolvers());
-    if(!aaaas.empty()) {
-      vector<string> as;
-      for(const auto& a : aaaas)
-        as.push_back(a.toString());
-      //      fmt::print("{} host has AAAA records {}\n", d_url, as);
-    }
-    else
-      ; // fmt::print("{} host does NOT have AAAA records\n", d_url);
-  }
-  
-  if(d_serverIP.has_value()) {
-    serverIP = fmt::format(" (server IP {})", d_serverIP->toString());
-    activeServerIP4 = *d_serverIP;
-    activeServerIP6 = *d_serverIP;
-  }
-  else if(!d_dns.empty()) {
-    vector<string> tofmt;
-    for(const auto& d : d_dns)
-      tofmt.push_back(d.toString());
-
-    //    fmt::print("Going to do DNS lookup for {} over at {} using source {}\n",
-    //               qname.toString(), tofmt, d_localIP.has_value() ? d_localIP->toString() : "default");
-    DTime dt;
-    std::vector<ComboAddress> r= DNSResolveAt(qname, DNSType::A, d_dns, d_localIP4, d_localIP6); 
-    activeServerIP4 = r.at(0);
-    d_results["ipv4"]["server-ip"] = activeServerIP4.toString();
-    dnsMsec4 = dt.lapUsec() / 1000.0;
-    d_results["ipv4"]["dns-msec"] = roundDec(dnsMsec4, 1);
-
-    serverIP = fmt::format(" (server IPv4 {} from DNS {})", activeServerIP4.toString(), tofmt);
-
-    r= DNSResolveAt(qname, DNSType::AAAA, d_dns, d_localIP4, d_localIP6); 
-    activeServerIP6 = r.at(0);
-    d_results["ipv6"]["server-ip"] = activeServerIP6.toString();
-    dnsMsec6 = dt.lapUsec() / 1000.0;
-    d_results["ipv6"]["dns-msec"] = roundDec(dnsMsec6, 1);
-
-    serverIP += fmt::format(" (server IPv6 {} from DNS {})", activeServerIP6.toString(), tofmt);
-    
-    //    fmt::print("Got: {}\n", serverIP);
-  }
-  
-  if(d_localIP4.has_value()) {
-    serverIP += fmt::format(" (local IPv4 {})", d_localIP4->toString());
-  }
-  if(d_localIP6.has_value()) {
-    serverIP += fmt::format(" (local IPv6 {})", d_localIP6->toString());
-  }
+  vector<string> tofmt;
+  for(const auto& d : d_dns)
+    tofmt.push_back(d.toString());
+
+  struct FamilyResult
+  {
+    std::map<std::string, SQLiteWriter::var_t> results;
+    std::vector<std::string> reasons;
+  };
 
-  CheckResult cr;
+  // the families resolve and probe at the same time, so a broken IPv6 path does not delay IPv4
   auto doCheck = [&](bool ipv6) {
-    DTime dt;
-    dt.start();
-    MiniCurl mc(d_agent); 
-    MiniCurl::certinfo_t certinfo;
-    // XXX also do POST
-    ComboAddress activeServerIP = ipv6 ? activeServerIP6 : activeServerIP4;
-
-    // if you hand picked an activeServerIP, we're only going to test the right family
-    if(!ipv6 && activeServerIP.sin4.sin_family && activeServerIP.sin4.sin_family != AF_INET)
-      return;
-    if(ipv6 && activeServerIP.sin4.sin_family && activeServerIP.sin4.sin_family != AF_INET6)
-      return;
-    
-    
-    string subject = ipv6 ? "ipv6" : "ipv4";
+    FamilyResult fr;
+    string serverIP;
+    // a failure only ends up in the reasons of this family
     try {
+      // only probe IPv6 if the name has AAAA records at all
+      if(ipv6 && (!*g_haveIPv6 || DNSResolveAt(qname, DNSType::AAAA, getResolvers()).empty()))
+        return fr;
+
+      ComboAddress activeServerIP;
+      activeServerIP.sin4.sin_family = 0; // "unset"
+      double dnsMsec = 0;
+      if(d_serverIP.has_value()) {
+        serverIP = fmt::format(" (server IP {})", d_serverIP->toString());
+        activeServerIP = *d_serverIP;
+      }
+      else if(!d_dns.empty()) {
+        //    fmt::print("Going to do DNS lookup for {} over at {} using source {}\n",
+        //               qname.toString(), tofmt, d_localIP.has_value() ? d_localIP->toString() : "default");
+        DTime dt;
+        // not cached, since we measure how long this takes
+        std::vector<ComboAddress> r= DNSResolveAt(qname, ipv6 ? DNSType::AAAA : DNSType::A, d_dns, d_localIP4, d_localIP6, false);
+        if(r.empty())
+          throw runtime_error(fmt::format("No {} address for {} from DNS {}", ipv6 ? "IPv6" : "IPv4", qname.toString(), tofmt));
+        activeServerIP = r.at(0);
+        fr.results["server-ip"] = activeServerIP.toString();
+        dnsMsec = dt.lapUsec() / 1000.0;
+        fr.results["dns-msec"] = roundDec(dnsMsec, 1);
+
+        serverIP = fmt::format(" (server {} {} from DNS {})", ipv6 ? "IPv6" : "IPv4", activeServerIP.toString(), tofmt);
+      }
+  
+      if(d_localIP4.has_value()) {
+        serverIP += fmt::format(" (local IPv4 {})", d_localIP4->toString());
+      }
+      if(d_localIP6.has_value()) {
+        serverIP += fmt::format(" (local IPv6 {})", d_localIP6->toString());
+      }
+
+      DTime dt;
+      dt.start();
+      MiniCurl mc(d_agent, d_reuse);
+      MiniCurl::certinfo_t certinfo;
+      // XXX also do POST
+
+      // if you hand picked an activeServerIP, we're only going to test the right family
+      if(!ipv6 && activeServerIP.sin4.sin_family && activeServerIP.sin4.sin_family != AF_INET)
+        return fr;
+      if(ipv6 && activeServerIP.sin4.sin_family && activeServerIP.sin4.sin_family != AF_INET6)
+        return fr;
+    
       ComboAddress li;
       if(!ipv6) {
         if(d_localIP4) li = *d_localIP4;
@@ -261,82 +349,123 @@ CheckResult HTTPSChecker::perform()
         else li = ComboAddress("::",0);
       }
       
-      string body = mc.getURL(d_url, d_method == "HEAD", &certinfo,
-                              activeServerIP.sin4.sin_family ? &activeServerIP : 0,
-                              &li);
-      
+      BodyInspector inspector(d_minBytes, d_maxBytes, d_sregex ? &*d_sregex : nullptr,
+                              d_regexStr.empty() ? nullptr : &d_regex, d_regexLineLocal);
+      mc.d_bodyFunc = std::ref(inspector);
+      // if all we care about is the age, the content itself only needs to come in when it changed
+      bool conditional = d_maxAgeMinutes > 0 && !d_minBytes && d_regexStr.empty();
+      auto& validator = d_validators[ipv6];
+      if(conditional) {
+        mc.d_ifNoneMatch = validator.etag;
+        mc.d_ifModifiedSince = validator.filetime;
+      }
+      mc.getURL(d_url, d_method == "HEAD", &certinfo,
+                activeServerIP.sin4.sin_family ? &activeServerIP : 0,
+                &li);
+      inspector.finish();
+      if(conditional) {
+        if(mc.d_http_code == 304) {
+          fr.results["not-modified"] = 1;
+          mc.d_filetime = validator.filetime;
+        }
+        else if(mc.d_http_code == 200) {
+          validator.etag = mc.d_etag;
+          validator.filetime = mc.d_filetime;
+        }
+      }
+
       
       double httpMsec = dt.lapUsec()/1000.0;
-      d_results[subject]["http-msec"]= roundDec(httpMsec, 1);
-      d_results[subject]["msec"] = roundDec((ipv6 ? dnsMsec6 : dnsMsec4) + httpMsec, 1);
-      d_results[subject]["http-code"] = (int32_t)mc.d_http_code;
+      fr.results["http-msec"]= roundDec(httpMsec, 1);
+      fr.results["msec"] = roundDec(dnsMsec + httpMsec, 1);
+      fr.results["http-code"] = (int32_t)mc.d_http_code;
+      // cumulative, so a regression shows up first in the phase that got slower
+      const auto& t = mc.d_timings;
+      fr.results["namelookup-msec"] = roundDec(t.namelookup / 1000.0, 1);
+      fr.results["connect-msec"] = roundDec(t.connect / 1000.0, 1);
+      fr.results["tls-msec"] = roundDec(t.appconnect / 1000.0, 1);
+      fr.results["pretransfer-msec"] = roundDec(t.pretransfer / 1000.0, 1);
+      fr.results["ttfb-msec"] = roundDec(t.starttransfer / 1000.0, 1);
+      fr.results["total-msec"] = roundDec(t.total / 1000.0, 1);
+      fr.results["redirect-msec"] = roundDec(t.redirect / 1000.0, 1);
+      fr.results["download-bps"] = (int64_t)t.downloadSpeed;
+      if(d_reuse) {
+        // keep-alive probes are a lot faster than cold ones, don't mix them up
+        fr.results["reused"] = (int32_t)(mc.d_numConnects == 0);
+        fr.results[mc.d_numConnects == 0 ? "http-msec-warm" : "http-msec-cold"] = roundDec(httpMsec, 1);
+      }
       
       if(mc.d_http_code >= 400) {
-        cr.d_reasons[subject].push_back(fmt::format("Content {} generated a {} status code{}", d_url, mc.d_http_code, serverIP));
-        return;
+        fr.reasons.push_back(fmt::format("Content {} generated a {} status code{}", d_url, mc.d_http_code, serverIP));
+        return fr;
       }
       
       time_t now = time(nullptr);
       if(d_maxAgeMinutes > 0 && mc.d_filetime > 0) {
         if(now - mc.d_filetime > d_maxAgeMinutes * 60) {
-          cr.d_reasons[subject].push_back(fmt::format("Content {} older than the {} minutes limit{}", d_url, d_maxAgeMinutes, serverIP));
-          return;
+          fr.reasons.push_back(fmt::format("Content {} older than the {} minutes limit{}", d_url, d_maxAgeMinutes, serverIP));
+          return fr;
         }
       }
       
       if(certinfo.empty())  {
-        cr.d_reasons[subject].push_back(fmt::format("No certificates for '{}'{}", d_url, serverIP));
-        return;
+        fr.reasons.push_back(fmt::format("No certificates for '{}'{}", d_url, serverIP));
+        return fr;
       }
-      d_results[subject]["bodySize"] = (int64_t)body.size();
-      if(body.size() < d_minBytes) {
-        cr.d_reasons[subject].push_back(fmt::format("URL {} was available{}, but did not deliver at least {} bytes of data", d_url, serverIP, d_minBytes));
-        return;
+      // with early stopping this is what we needed to download, not the full size
+      fr.results["bodySize"] = (int64_t)inspector.d_bytes;
+      if(inspector.d_truncated)
+        fr.results["bodyTruncated"] = 1;
+      if(inspector.d_bytes < d_minBytes) {
+        fr.reasons.push_back(fmt::format("URL {} was available{}, but did not deliver at least {} bytes of data", d_url, serverIP, d_minBytes));
+        return fr;
       }
       
-      if(!d_regexStr.empty() && !std::regex_search(body, d_regex)) {
-        cr.d_reasons[subject].push_back(fmt::format("URL {} was available{}, but the response did not contain a match for the regular expression '{}'", d_url, serverIP, d_regexStr));
-        return;
+      if(!d_regexStr.empty() && !inspector.d_matched) {
+        fr.reasons.push_back(fmt::format("URL {} was available{}, but the {} did not contain a match for the regular expression '{}'", d_url, serverIP,
+                                                    inspector.d_truncated ? fmt::format("first {} bytes of the response", d_maxBytes) : "response",
+                                                    d_regexStr));
+        return fr;
       }
       
       time_t minexptime = std::numeric_limits<time_t>::max();
       
-      for(auto& cert: certinfo) {
-        struct tm tm={};
-        // Jul 29 00:00:00 2023 GMT
-        
-        strptime(cert.second["Expire date"].c_str(), "%b %d %H:%M:%S %Y", &tm);
-        time_t expire = mktime(&tm);
-        strptime(cert.second["Start date"].c_str(), "%b %d %H:%M:%S %Y", &tm);
-        time_t start = mktime(&tm);
-        
-        if(now < start) {
-          cr.d_reasons[subject].push_back(fmt::format("certificate for {} not yet valid{}",
+      for(const auto& cert: certinfo) {
+        if(now < cert.notBefore) {
+          fr.reasons.push_back(fmt::format("certificate for {} not yet valid{}",
                                                       d_url, serverIP));
-          return;
+          return fr;
         }
-        //    fmt::print("days left: {:.1f}\n", (expire - now)/86400.0);
-        minexptime = min(expire, minexptime);
+        //    fmt::print("days left: {:.1f}\n", (cert.notAfter - now)/86400.0);
+        minexptime = min(cert.notAfter, minexptime);
       }
       double days = (minexptime - now)/86400.0;
-      d_results[subject]["tlsMinExpDays"] = roundDec(days, 1);
+      fr.results["tlsMinExpDays"] = roundDec(days, 1);
       //  fmt::print("'{}': first cert expires in {:.1f} days (lim {})\n", d_url, days,
       //             d_minCertDays);
       if(days < d_minCertDays) {
-        cr.d_reasons[subject].push_back(fmt::format("A certificate for '{}' expires in {:d} days{}",
+        fr.reasons.push_back(fmt::format("A certificate for '{}' expires in {:d} days{}",
                                                     d_url, (int)round(days), serverIP));
-        return;
+        return fr;
       }
     }
     catch(exception& e) {
-      cr.d_reasons[subject].push_back(e.what() + serverIP);
+      fr.reasons.push_back(e.what() + serverIP);
     }
-    
+    return fr;
   };
 
-  doCheck(false);
-  if(!aaaas.empty())
-    doCheck(true);
+  auto v4 = std::async(std::launch::async, doCheck, false);
+  auto v6 = std::async(std::launch::async, doCheck, true);
+  CheckResult cr;
+  for(auto* f : {&v4, &v6}) {
+    string subject = f == &v6 ? "ipv6" : "ipv4";
+    auto fr = f->get();
+    if(!fr.results.empty())
+      d_results[subject] = std::move(fr.results);
+    if(!fr.reasons.empty())
+      cr.d_reasons[subject] = std::move(fr.reasons);
+  }
   return cr;
 }
     
@@ -387,115 +516,9 @@ CheckResult HTTPRedirChecker::perform()
 }
 
 
-namespace {
-struct icmppacket
-{
-	struct icmphdr hdr;
-	char msg[];
-};
-}
-/*--------------------------------------------------------------------*/
-/*--- checksum - standard 1s complement checksum                   ---*/
-/*--------------------------------------------------------------------*/
-static unsigned short internetchecksum(void *b, int len)
-{	unsigned short *buf = (unsigned short*)b;
-	unsigned int sum=0;
-	unsigned short result;
-
-	for ( sum = 0; len > 1; len -= 2 )
-		sum += *buf++;
-	if ( len == 1 )
-		sum += *(unsigned char*)buf;
-	sum = (sum >> 16) + (sum & 0xFFFF);
-	sum += (sum >> 16);
-	result = ~sum;
-	return result;
-}
-
-static std::string makeICMPQuery(int family, uint16_t id, uint16_t seq, size_t psize)
-{
-  if(family==AF_INET) {
-    size_t full_size = sizeof(icmphdr) + psize;
-    vector<char> store(full_size, 0);
-    icmppacket *p = (icmppacket *)store.data();
-
-    p->hdr.type = ICMP_ECHO;
-    p->hdr.un.echo.id = id;
-    p->hdr.un.echo.sequence = seq;
-    unsigned int i;
-    for(i = 0; i < psize; i++) {
-      p->msg[i] = (char)i;
-    }
-
-    p->hdr.checksum = 0;
-    p->hdr.checksum = internetchecksum(p, full_size);
-    return std::string((const char*)p, full_size);
-  }
-  else {
-    /* compose ICMPv6 packet */
-    size_t full_size = sizeof(struct icmp6_hdr) + psize;
-    vector<char> store(full_size, 0);
-    void *packet = store.data();
-    struct icmp6_hdr *hdr = (struct icmp6_hdr *)packet;
-
-    hdr->icmp6_type                      = ICMP6_ECHO_REQUEST;
-    hdr->icmp6_code                      = 0;
-    hdr->icmp6_dataun.icmp6_un_data16[0] = id; /* identifier */
-    hdr->icmp6_dataun.icmp6_un_data16[1] = seq; /* sequence no */
-
-    /* fill the rest of the packet */
-    unsigned char *data = (unsigned char *)(hdr + 1);
-    for (size_t i = 0; i < psize; i++)
-      data[i] = i;
-
-    return std::string((const char*)hdr, full_size);
-  }
-}
-
-
-static void fillMSGHdr(struct msghdr* msgh, struct iovec* iov, char* cbuf, int buflen, char* data, size_t datalen, ComboAddress* addr)
-{
-  iov->iov_base = data;
-  iov->iov_len  = datalen;
-
-  memset(msgh, 0, sizeof(struct msghdr));
-  
-  msgh->msg_control = cbuf;
-  msgh->msg_controllen = buflen;
-  msgh->msg_name = addr;
-  msgh->msg_namelen = addr->getSocklen();
-  msgh->msg_iov  = iov;
-  msgh->msg_iovlen = 1;
-  msgh->msg_flags = 0;
-}
-
-
-/*
-recvmsg(3, 
-{msg_name={sa_family=AF_INET, sin_port=htons(0), sin_addr=inet_addr("1.1.1.1")}, msg_namelen=128 => 16, msg_iov=[{iov_base="\0\0\345\\\1\t\0\1J\31\366e\0\0\0\0\26G\4\0\0\0\0\0\20\21\22\23\24\25\26\27"..., iov_len=192}], msg_iovlen=1, 
-msg_control=[
-{cmsg_len=32, cmsg_level=SOL_SOCKET, cmsg_type=SO_TIMESTAMP_OLD, cmsg_data={tv_sec=1710627146, tv_usec=285083}}, 
-{cmsg_len=20, cmsg_level=SOL_IP, cmsg_type=IP_TTL, cmsg_data=[59]}], 
-msg_controllen=56, msg_flags=0}, 0) = 64
-*/
-
-bool HarvestTTL(struct msghdr* msgh, int* ttl) 
-{
-  struct cmsghdr *cmsg;
-  for (cmsg = CMSG_FIRSTHDR(msgh); cmsg != NULL; cmsg = CMSG_NXTHDR(msgh,cmsg)) {
-    if ((cmsg->cmsg_level == SOL_IP) && (cmsg->cmsg_type == IP_TTL) && 
-        CMSG_LEN(sizeof(*ttl)) == cmsg->cmsg_len) {
-      memcpy(ttl, CMSG_DATA(cmsg), sizeof(*ttl));
-      return true;
-    }
-  }
-  return false;
-}
-
-
 PINGChecker::PINGChecker(sol::table data) : Checker(data, 2)
 {
-  checkLuaTable(data, {"servers"}, {"localIP", "timeout", "size", "df"});
+  checkLuaTable(data, {"servers"}, {"localIP", "timeout", "size", "df", "count", "spacing", "maxLoss", "maxRtt"});
   for(const auto& s: data.get<vector<string>>("servers")) {
     d_servers.insert(ComboAddress(s));
   }
@@ -517,6 +540,24 @@ PINGChecker::PINGChecker(sol::table data) : Checker(data, 2)
   /* Based on observation, old default was DF is set */
   d_dontFragment = data.get_or("df", true);
 
+  d_count = data.get_or("count", 1);
+  if(d_count < 1 || d_count > 100)
+    throw runtime_error("ping count must be between 1 and 100");
+  d_spacing = data.get_or("spacing", 0.2);
+  if(d_spacing < 0.001)
+    throw runtime_error("ping spacing must be at least a millisecond");
+  sol::optional<double> maxLoss = data["maxLoss"], maxRtt = data["maxRtt"];
+  if(maxLoss) {
+    d_maxLoss = *maxLoss;
+    d_attributes["maxLoss"] = *maxLoss;
+  }
+  if(maxRtt) {
+    d_maxRtt = *maxRtt;
+    d_attributes["maxRtt"] = *maxRtt;
+  }
+  if(d_count > 1)
+    d_attributes["count"] = d_count;
+
   try {
     Socket sock(AF_INET, SOCK_DGRAM, IPPROTO_ICMP);
   }
@@ -525,60 +566,242 @@ PINGChecker::PINGChecker(sol::table data) : Checker(data, 2)
   }
 }
 
+namespace {
+//! What we learned from a few pings to one server
+struct PingStats
+{
+  explicit PingStats(vector<double> rtts) : d_rtts(std::move(rtts))
+  {
+    if(d_rtts.empty())
+      return;
+    double sum = 0, sumsq = 0, diffs = 0;
+    for(size_t n = 0; n < d_rtts.size(); ++n) {
+      sum += d_rtts[n];
+      sumsq += d_rtts[n] * d_rtts[n];
+      if(n)
+        diffs += fabs(d_rtts[n] - d_rtts[n - 1]);
+    }
+    d_avg = sum / d_rtts.size();
+    d_mdev = sqrt(std::max(0.0, sumsq / d_rtts.size() - d_avg * d_avg)); // like ping(8)
+    if(d_rtts.size() > 1)
+      d_jitter = diffs / (d_rtts.size() - 1);
+    std::sort(d_rtts.begin(), d_rtts.end());
+    d_p95 = d_rtts[ceil(0.95 * d_rtts.size()) - 1]; // nearest rank
+  }
+  vector<double> d_rtts; //!< sorted
+  double d_avg = 0, d_mdev = 0, d_jitter = 0, d_p95 = 0;
+};
+}
+
 CheckResult PINGChecker::perform()
 {
   d_results.clear();
   CheckResult ret;
-  for(const auto& s : d_servers) {
-    Socket sock(s.sin4.sin_family, SOCK_DGRAM, (s.sin4.sin_family == AF_INET) ? (int)IPPROTO_ICMP : (int)IPPROTO_ICMPV6);
-    if(d_localIP) {
-      SBind(sock, *d_localIP);
+  // all at the same time, so this takes one timeout, not one per server
+  map<ComboAddress, vector<std::future<PingEngine::Reply>>> replies;
+  for(int n = 0; n < d_count; ++n)
+    for(const auto& s : d_servers)
+      replies[s].push_back(PingEngine::instance().submit(s, d_timeout, d_size, d_dontFragment, d_localIP, n * d_spacing));
+
+  for(auto& [s, fs] : replies) {
+    vector<double> rtts;
+    double userMsec = 0;
+    int ttl = -1;
+    string error;
+    for(auto& f : fs) {
+      try {
+        auto reply = f.get();
+        rtts.push_back(reply.msec);
+        userMsec += reply.userMsec;
+        ttl = reply.ttl;
+      }
+      catch(std::exception& e) {
+        if(error.empty())
+          error = e.what();
+      }
+    }
+    double loss = 100.0 * (d_count - rtts.size()) / d_count;
+    auto& results = d_results[s.toString()];
+    results["loss"] = loss;
+    if(rtts.empty()) {
+      ret.d_reasons[s.toStringWithPort()].push_back(error);
+      continue;
     }
+    PingStats stats(std::move(rtts));
+    results["msec"] = roundDec(stats.d_avg, 1);
+    results["user-msec"] = roundDec(userMsec / stats.d_rtts.size(), 1);
+    results["ttl"] = ttl;
+    if(d_count > 1) {
+      results["min-msec"] = roundDec(stats.d_rtts.front(), 1);
+      results["max-msec"] = roundDec(stats.d_rtts.back(), 1);
+      results["mdev-msec"] = roundDec(stats.d_mdev, 2);
+      results["jitter-msec"] = roundDec(stats.d_jitter, 2);
+      results["p95-msec"] = roundDec(stats.d_p95, 1);
+    }
+    if(d_maxLoss && loss > *d_maxLoss)
+      ret.d_reasons[s.toStringWithPort()].push_back(fmt::format("Lost {:.0f}% of pings to {}, more than {}%: {}", loss, s.toString(), *d_maxLoss, error));
+    if(d_maxRtt && stats.d_avg > *d_maxRtt)
+      ret.d_reasons[s.toStringWithPort()].push_back(fmt::format("Pings to {} took {:.1f} msec on average, more than {} msec", s.toString(), stats.d_avg, *d_maxRtt));
+  }
+  return ret;
+}
+
+TraceRouteChecker::TraceRouteChecker(sol::table data) : Checker(data, 2)
+{
+  checkLuaTable(data, {"servers"}, {"localIP", "timeout", "size", "maxHops", "count", "spacing", "maxLoss", "alertOnPathChange"});
+  for(const auto& s: data.get<vector<string>>("servers")) {
+    d_servers.insert(ComboAddress(s));
+  }
+  string localip= data.get_or("localIP", string(""));
+  if(!localip.empty()) {
+    d_localIP = ComboAddress(localip);
+    d_attributes["localIP"] = d_localIP->toString();
+  }
 
-    SConnect(sock, s);
-    SSetsockopt(sock, SOL_IP, IP_RECVTTL, 1);
+  d_timeout = data.get_or("timeout", 1.0);
+  if (d_timeout <= 0 || d_timeout > 10)
+    throw runtime_error("traceroute timeout must be reasonable, between 0 and 10 seconds");
+  d_size = data.get_or("size", 56);
+  if(d_size > 65500)
+    throw runtime_error("traceroute size must be between 0 and 65500");
+  d_maxHops = data.get_or("maxHops", 30);
+  if(d_maxHops < 1 || d_maxHops > 64)
+    throw runtime_error("traceroute maxHops must be between 1 and 64");
+  d_count = data.get_or("count", 3);
+  if(d_count < 1 || d_count > 20)
+    throw runtime_error("traceroute count must be between 1 and 20");
+  d_spacing = data.get_or("spacing", 0.2);
+  if(d_spacing < 0.001)
+    throw runtime_error("traceroute spacing must be at least a millisecond");
+  sol::optional<double> maxLoss = data["maxLoss"];
+  if(maxLoss) {
+    d_maxLoss = *maxLoss;
+    d_attributes["maxLoss"] = *maxLoss;
+  }
+  d_alertOnPathChange = data.get_or("alertOnPathChange", false);
+}
 
-    if (s.sin4.sin_family == AF_INET) {
-      if (d_dontFragment) {
-        SSetsockopt(sock, IPPROTO_IP, IP_MTU_DISCOVER, IP_PMTUDISC_DO);
-      } else {
-        SSetsockopt(sock, IPPROTO_IP, IP_MTU_DISCOVER, IP_PMTUDISC_DONT);
+/* Like mtr, but all hops get probed at the same time: for every hop limit from 1 to maxHops we
+   send count echo requests, and routers along the way send back time exceeded. The first hop
+   limit that gets an echo reply from the server itself is the length of the path. If nothing
+   gets there, the first hop after the last one that answered is where the path breaks. */
+CheckResult TraceRouteChecker::perform()
+{
+  d_results.clear();
+  CheckResult ret;
+  struct Probe
+  {
+    int ttl;
+    std::future<PingEngine::Reply> reply;
+  };
+  map<ComboAddress, vector<Probe>> probes;
+  for(int n = 0; n < d_count; ++n)
+    for(const auto& s : d_servers)
+      for(int ttl = 1; ttl <= d_maxHops; ++ttl)
+        probes[s].push_back({ttl, PingEngine::instance().submit(s, d_timeout, d_size, false, d_localIP, n * d_spacing, ttl)});
+
+  // mtr shows a hop nobody answered for as ???, we use *
+  auto describe = [](const set<string>& from) {
+    return from.empty() ? string("*") : fmt::format("{}", fmt::join(from, ","));
+  };
+  for(auto& [s, ps] : probes) {
+    struct Hop
+    {
+      set<string> from;
+      vector<double> rtts;
+      int answered = 0;
+      string unreachable; //!< what the router that could not get there said
+    };
+    vector<Hop> hops(d_maxHops + 1); // by hop limit
+    int reached = 0, unreachableAt = 0, lastAnswered = 0;
+    for(auto& p : ps) {
+      auto& hop = hops[p.ttl];
+      try {
+        auto r = p.reply.get();
+        hop.from.insert(r.from.toString());
+        hop.rtts.push_back(r.msec);
+        if(!r.timeExceeded && (!reached || p.ttl < reached))
+          reached = p.ttl;
+      }
+      catch(PingEngine::Unreachable& e) {
+        hop.from.insert(e.from.toString());
+        hop.unreachable = e.what();
+        if(!unreachableAt || p.ttl < unreachableAt)
+          unreachableAt = p.ttl;
       }
+      catch(std::exception&) {
+        continue; // lost, or the router does not send time exceeded, or not that often
+      }
+      hop.answered++;
+      lastAnswered = max(lastAnswered, p.ttl);
     }
 
-    string packet = makeICMPQuery(s.sin4.sin_family, 1, 1, d_size);
-    DTime dt;
-    dt.start();
-    SWrite(sock, packet);
-
-    double timeo = d_timeout;
-    if(!waitForData(sock, &timeo)) {
-      ret.d_reasons[s.toStringWithPort()].push_back(fmt::format("Timeout waiting for ping response from {}",
-                                        s.toString()));
-      continue;
+    int end = reached ? reached : unreachableAt ? unreachableAt : min(d_maxHops, lastAnswered + 1);
+    path_t path;
+    for(int ttl = 1; ttl <= end; ++ttl) {
+      const auto& hop = hops[ttl];
+      path.push_back(hop.from);
+      auto& results = d_results[fmt::format("{} hop {}", s.toString(), ttl)];
+      results["hop"] = ttl;
+      results["address"] = describe(hop.from);
+      results["loss"] = 100.0 * (d_count - hop.answered) / d_count;
+      if(!hop.rtts.empty())
+        results["msec"] = roundDec(std::accumulate(hop.rtts.begin(), hop.rtts.end(), 0.0) / hop.rtts.size(), 2);
     }
-    string payload;
-    ComboAddress server=s;
 
-    struct msghdr msgh;
-    struct iovec iov;
-    char cbuf[256];
-    
-    char respbuf[1500];
-    fillMSGHdr(&msgh, &iov, cbuf, sizeof(cbuf), respbuf, sizeof(respbuf), &server);
-    
-    int len = recvmsg(sock, &msgh, 0);
-    if(len < 0) {
-      ret.d_reasons[s.toStringWithPort()].push_back("Receiving ping response from "+s.toString()+": " + string(strerror(errno)));
+    auto& results = d_results[s.toString()];
+    vector<string> described;
+    for(const auto& h : path)
+      described.push_back(describe(h));
+    results["hops"] = end;
+    results["reached"] = (int32_t)(reached > 0);
+    results["path"] = fmt::format("{}", fmt::join(described, " "));
+    if(!reached) {
+      string reason;
+      if(unreachableAt)
+        reason = fmt::format("Path to {} ends at hop {}: {}", s.toString(), unreachableAt, hops[unreachableAt].unreachable);
+      else if(lastAnswered)
+        reason = fmt::format("No reply from {}, the path ends after hop {} ({})", s.toString(), lastAnswered, describe(hops[lastAnswered].from));
+      else
+        reason = fmt::format("No reply from {}, nor from any hop on the way", s.toString());
+      ret.d_reasons[s.toStringWithPort()].push_back(reason);
       continue;
     }
-    int ttl = -1;
-    HarvestTTL(&msgh, &ttl);
 
-    d_results[s.toString()]["msec"] = roundDec(dt.lapUsec()/1000.0, 1 );
-    d_results[s.toString()]["ttl"] = ttl;
-    //    fmt::print("Got ping response from {} with id {} and seq {}: {} msec\n",
-    //               s.toString(), id, seq, dt.lapUsec()/1000.0);
+    // every probe from the path length on made it to the server
+    int answered = 0;
+    vector<double> rtts;
+    for(int ttl = reached; ttl <= d_maxHops; ++ttl) {
+      answered += hops[ttl].answered;
+      rtts.insert(rtts.end(), hops[ttl].rtts.begin(), hops[ttl].rtts.end());
+    }
+    double loss = 100.0 - 100.0 * answered / (d_count * (d_maxHops - reached + 1));
+    results["loss"] = loss;
+    results["msec"] = roundDec(std::accumulate(rtts.begin(), rtts.end(), 0.0) / rtts.size(), 2);
+    if(d_maxLoss && loss > *d_maxLoss)
+      ret.d_reasons[s.toStringWithPort()].push_back(fmt::format("Lost {:.0f}% of probes to {}, more than {}%", loss, s.toString(), *d_maxLoss));
+
+    /* Routers that rate limit time exceeded leave holes, and with ECMP a hop can be any of a few
+       routers. So a hop only changed if it answered both times, from a different router */
+    auto& prev = d_paths[s];
+    string change;
+    int changedAt = 0;
+    for(size_t n = 0; n < min(prev.size(), path.size()) && !changedAt; ++n) {
+      if(prev[n].empty() || path[n].empty())
+        continue;
+      if(std::none_of(path[n].begin(), path[n].end(), [&](const string& a) { return prev[n].count(a); })) {
+        changedAt = n + 1;
+        change = fmt::format("Path to {} changed at hop {}: {} -> {}", s.toString(), changedAt, describe(prev[n]), describe(path[n]));
+      }
+    }
+    if(!changedAt && !prev.empty() && prev.size() != path.size()) {
+      changedAt = min(prev.size(), path.size()) + 1;
+      change = fmt::format("Path to {} went from {} to {} hops", s.toString(), prev.size(), path.size());
+    }
+    results["path-changed"] = changedAt;
+    if(changedAt && d_alertOnPathChange)
+      ret.d_reasons[s.toStringWithPort()].push_back(change);
+    prev = std::move(path);
   }
   return ret;
 }
@@ -0,0 +1,447 @@
+#include "pingengine.hh"
+#include "kerneltime.hh"
+#include "fmt/format.h"
+#include <cmath>
+#include <cstring>
+#include <poll.h>
+#include <netinet/in.h>
+#include <netinet/ip_icmp.h>
+#include <netinet/icmp6.h>
+#include <linux/errqueue.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <vector>
+
+using namespace std;
+
+namespace {
+constexpr auto c_sendInterval = std::chrono::milliseconds(1); //!< between two echo requests, like fping -i
+constexpr int c_rcvBuf = 1024 * 1024;
+
+struct icmppacket
+{
+	struct icmphdr hdr;
+	char msg[];
+};
+
+/*--------------------------------------------------------------------*/
+/*--- checksum - standard 1s complement checksum                   ---*/
+/*--------------------------------------------------------------------*/
+unsigned short internetchecksum(void *b, int len)
+{	unsigned short *buf = (unsigned short*)b;
+	unsigned int sum=0;
+	unsigned short result;
+
+	for ( sum = 0; len > 1; len -= 2 )
+		sum += *buf++;
+	if ( len == 1 )
+		sum += *(unsigned char*)buf;
+	sum = (sum >> 16) + (sum & 0xFFFF);
+	sum += (sum >> 16);
+	result = ~sum;
+	return result;
+}
+
+std::string makeICMPQuery(int family, uint16_t id, uint16_t seq, size_t psize)
+{
+  if(family==AF_INET) {
+    size_t full_size = sizeof(icmphdr) + psize;
+    vector<char> store(full_size, 0);
+    icmppacket *p = (icmppacket *)store.data();
+
+    p->hdr.type = ICMP_ECHO;
+    p->hdr.un.echo.id = id;
+    p->hdr.un.echo.sequence = seq;
+    unsigned int i;
+    for(i = 0; i < psize; i++) {
+      p->msg[i] = (char)i;
+    }
+
+    p->hdr.checksum = 0;
+    p->hdr.checksum = internetchecksum(p, full_size);
+    return std::string((const char*)p, full_size);
+  }
+  else {
+    /* compose ICMPv6 packet */
+    size_t full_size = sizeof(struct icmp6_hdr) + psize;
+    vector<char> store(full_size, 0);
+    void *packet = store.data();
+    struct icmp6_hdr *hdr = (struct icmp6_hdr *)packet;
+
+    hdr->icmp6_type                      = ICMP6_ECHO_REQUEST;
+    hdr->icmp6_code                      = 0;
+    hdr->icmp6_dataun.icmp6_un_data16[0] = id; /* identifier */
+    hdr->icmp6_dataun.icmp6_un_data16[1] = seq; /* sequence no */
+
+    /* fill the rest of the packet */
+    unsigned char *data = (unsigned char *)(hdr + 1);
+    for (size_t i = 0; i < psize; i++)
+      data[i] = i;
+
+    return std::string((const char*)hdr, full_size);
+  }
+}
+
+//! Ignores the port, and the scope of link local IPv6 addresses
+bool sameAddress(const ComboAddress& a, const ComboAddress& b)
+{
+  if(a.sin4.sin_family != b.sin4.sin_family)
+    return false;
+  if(a.sin4.sin_family == AF_INET)
+    return a.sin4.sin_addr.s_addr == b.sin4.sin_addr.s_addr;
+  return !memcmp(&a.sin6.sin6_addr, &b.sin6.sin6_addr, sizeof(a.sin6.sin6_addr));
+}
+}
+
+PingEngine& PingEngine::instance()
+{
+  static PingEngine s_engine;
+  return s_engine;
+}
+
+PingEngine::PingEngine()
+{
+  d_wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if(d_wakefd < 0)
+    throw runtime_error(fmt::format("Unable to create eventfd for the ping engine: {}", strerror(errno)));
+  d_thread = std::thread(&PingEngine::worker, this);
+}
+
+PingEngine::~PingEngine()
+{
+  {
+    std::lock_guard<std::mutex> l(d_lock);
+    d_stop = true;
+  }
+  wake();
+  d_thread.join();
+  close(d_wakefd);
+}
+
+PingEngine::Sock::~Sock()
+{
+  if(fd >= 0)
+    close(fd);
+}
+
+std::future<PingEngine::Reply> PingEngine::submit(const ComboAddress& target, double timeout, size_t size, bool dontFragment,
+                                                  std::optional<ComboAddress> local, double delay, int ttl)
+{
+  auto promise = std::make_shared<std::promise<Reply>>();
+  auto ret = promise->get_future();
+  submit(target, timeout, size, dontFragment, local, [promise](std::exception_ptr e, Reply&& r) {
+    if(e)
+      promise->set_exception(e);
+    else
+      promise->set_value(r);
+  }, delay, ttl);
+  return ret;
+}
+
+void PingEngine::submit(const ComboAddress& target, double timeout, size_t size, bool dontFragment,
+                        std::optional<ComboAddress> local, callback_t done, double delay, int ttl)
+{
+  if(target.sin4.sin_family != AF_INET && target.sin4.sin_family != AF_INET6)
+    throw std::runtime_error("Can only ping IPv4 and IPv6 addresses");
+  if(ttl < 0 || ttl > 255)
+    throw std::runtime_error("Ping ttl must be between 0 and 255");
+  {
+    std::lock_guard<std::mutex> l(d_lock);
+    d_queue.push_back({target, local, timeout, size, dontFragment, ttl, std::move(done),
+                       std::chrono::steady_clock::now() + std::chrono::microseconds((int64_t)(delay * 1000000))});
+  }
+  wake();
+}
+
+void PingEngine::wake()
+{
+  uint64_t one = 1;
+  // this only fails if the counter is about to overflow, and then the I/O thread wakes up anyway
+  ssize_t ret = write(d_wakefd, &one, sizeof(one));
+  (void)ret;
+}
+
+PingEngine::Sock& PingEngine::getSock(const Echo& echo)
+{
+  int family = echo.target.sin4.sin_family;
+  auto& sock = d_socks[{family, echo.local ? echo.local->toString() : "", echo.dontFragment, echo.ttl}];
+  if(sock)
+    return *sock;
+
+  auto ret = std::make_unique<Sock>();
+  ret->family = family;
+  ret->fd = socket(family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, family == AF_INET ? (int)IPPROTO_ICMP : (int)IPPROTO_ICMPV6);
+  if(ret->fd < 0)
+    throw runtime_error(fmt::format("Unable to create ping socket: {}", strerror(errno)));
+  int one = 1, bufsize = c_rcvBuf;
+  setsockopt(ret->fd, SOL_SOCKET, SO_RCVBUF, &bufsize, sizeof(bufsize));
+  ret->kernelTimestamps = enableKernelTimestamps(ret->fd);
+  if(family == AF_INET) {
+    setsockopt(ret->fd, SOL_IP, IP_RECVTTL, &one, sizeof(one));
+    int pmtu = echo.dontFragment ? IP_PMTUDISC_DO : IP_PMTUDISC_DONT;
+    setsockopt(ret->fd, IPPROTO_IP, IP_MTU_DISCOVER, &pmtu, sizeof(pmtu));
+  }
+  else
+    setsockopt(ret->fd, IPPROTO_IPV6, IPV6_RECVHOPLIMIT, &one, sizeof(one));
+  if(echo.ttl) {
+    int ttl = echo.ttl;
+    if(setsockopt(ret->fd, family == AF_INET ? IPPROTO_IP : IPPROTO_IPV6, family == AF_INET ? IP_TTL : IPV6_UNICAST_HOPS, &ttl, sizeof(ttl)) < 0 ||
+       setsockopt(ret->fd, family == AF_INET ? IPPROTO_IP : IPPROTO_IPV6, family == AF_INET ? IP_RECVERR : IPV6_RECVERR, &one, sizeof(one)) < 0)
+      throw runtime_error(fmt::format("Unable to set hop limit on ping socket: {}", strerror(errno)));
+  }
+  if(echo.local && ::bind(ret->fd, (struct sockaddr*)&*echo.local, echo.local->getSocklen()) < 0)
+    throw runtime_error(fmt::format("Unable to bind ping socket to {}: {}", echo.local->toString(), strerror(errno)));
+  sock = std::move(ret);
+  return *sock;
+}
+
+void PingEngine::send(Echo& echo, time_point now)
+{
+  Sock* sock;
+  try {
+    sock = &getSock(echo);
+  }
+  catch(...) {
+    d_socks.erase({echo.target.sin4.sin_family, echo.local ? echo.local->toString() : "", echo.dontFragment, echo.ttl});
+    echo.done(std::current_exception(), Reply());
+    return;
+  }
+  if(sock->pending.size() >= 65536) { // can't happen with sane timeouts, but then we'd loop forever below
+    echo.done(std::make_exception_ptr(runtime_error("Too many pings in flight")), Reply());
+    return;
+  }
+  do {
+    ++sock->seq;
+  } while(sock->pending.count(sock->seq));
+
+  // the kernel fills out the identifier
+  string packet = makeICMPQuery(sock->family, 0, sock->seq, echo.size);
+  auto& p = sock->pending[sock->seq];
+  p.target = echo.target;
+  p.done = std::move(echo.done);
+  p.deadline = d_deadlines.insert({now + std::chrono::microseconds((int64_t)(echo.timeout * 1000000)), {sock, sock->seq}});
+  clock_gettime(CLOCK_REALTIME, &p.sent);
+  p.userSent = std::chrono::steady_clock::now();
+  if(sendto(sock->fd, packet.c_str(), packet.size(), 0, (struct sockaddr*)&echo.target, echo.target.getSocklen()) >= 0) {
+    // the kernel numbers its send timestamps in the order the packets went out
+    p.txid = sock->sent++;
+    sock->txids[*p.txid] = sock->seq;
+  }
+  else
+    finish(*sock, sock->pending.find(sock->seq),
+           std::make_exception_ptr(runtime_error(fmt::format("Unable to send ping to {}: {}", echo.target.toString(), strerror(errno)))),
+           Reply());
+}
+
+//! Removes the echo from sock and reports e or r to whoever asked
+void PingEngine::finish(Sock& sock, std::map<uint16_t, Pending>::iterator iter, std::exception_ptr e, Reply&& r)
+{
+  auto done = std::move(iter->second.done);
+  d_deadlines.erase(iter->second.deadline);
+  if(iter->second.txid)
+    sock.txids.erase(*iter->second.txid);
+  sock.pending.erase(iter);
+  done(e, std::move(r));
+}
+
+//! Times the reply to p, which came with the control messages in msgh
+PingEngine::Reply PingEngine::makeReply(const Pending& p, const struct msghdr& msgh)
+{
+  Reply r;
+  r.from = p.target;
+  r.userMsec = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - p.userSent).count();
+  for(auto cmsg = CMSG_FIRSTHDR(&msgh); cmsg; cmsg = CMSG_NXTHDR((struct msghdr*)&msgh, cmsg)) {
+    if((cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_TTL) ||
+       (cmsg->cmsg_level == IPPROTO_IPV6 && cmsg->cmsg_type == IPV6_HOPLIMIT))
+      memcpy(&r.ttl, CMSG_DATA(cmsg), sizeof(r.ttl));
+  }
+  struct timespec received;
+  if(getRXTimestamp(msgh, received)) {
+    // without a send timestamp, our own clock reading from just before sendto() is the next best thing
+    bool haveTX = p.txKernel.tv_sec && msecBetween(p.sent, p.txKernel) >= 0;
+    r.msec = msecBetween(haveTX ? p.txKernel : p.sent, received);
+    r.kernel = haveTX;
+  }
+  else
+    r.msec = r.userMsec;
+  return r;
+}
+
+//! Send timestamps, and on sockets with a ttl, ICMP errors about our echo requests
+void PingEngine::receiveErrors(Sock& sock)
+{
+  for(;;) {
+    char buf[1500];
+    union {
+      struct cmsghdr align;
+      char buf[512];
+    } cbuf;
+    ComboAddress to;
+    struct iovec iov{buf, sizeof(buf)};
+    struct msghdr msgh;
+    memset(&msgh, 0, sizeof(msgh));
+    msgh.msg_name = &to;
+    msgh.msg_namelen = sizeof(to);
+    msgh.msg_iov = &iov;
+    msgh.msg_iovlen = 1;
+    msgh.msg_control = cbuf.buf;
+    msgh.msg_controllen = sizeof(cbuf.buf);
+
+    ssize_t len = recvmsg(sock.fd, &msgh, MSG_ERRQUEUE | MSG_DONTWAIT);
+    if(len < 0)
+      return;
+    uint32_t txid;
+    struct timespec ts;
+    if(getTXTimestamp(msgh, txid, ts)) {
+      auto iter = sock.txids.find(txid);
+      if(iter != sock.txids.end())
+        sock.pending[iter->second].txKernel = ts;
+      continue;
+    }
+
+    const struct sock_extended_err* see = nullptr;
+    for(auto cmsg = CMSG_FIRSTHDR(&msgh); cmsg; cmsg = CMSG_NXTHDR(&msgh, cmsg))
+      if((cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) ||
+         (cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR))
+        see = (const struct sock_extended_err*)CMSG_DATA(cmsg);
+    if(!see || (see->ee_origin != SO_EE_ORIGIN_ICMP && see->ee_origin != SO_EE_ORIGIN_ICMP6) || len < 8)
+      continue;
+    // the payload is our echo request, to gets where it was going
+    uint16_t seq;
+    memcpy(&seq, buf + 6, 2);
+    auto iter = sock.pending.find(seq);
+    if(iter == sock.pending.end() || !sameAddress(to, iter->second.target))
+      continue;
+
+    auto sa = SO_EE_OFFENDER(see);
+    if(sa->sa_family != AF_INET && sa->sa_family != AF_INET6)
+      continue;
+    ComboAddress offender;
+    memcpy(&offender.sin6, sa, sa->sa_family == AF_INET ? sizeof(struct sockaddr_in) : sizeof(struct sockaddr_in6));
+    bool exceeded = sock.family == AF_INET ? see->ee_type == ICMP_TIME_EXCEEDED : see->ee_type == ICMP6_TIME_EXCEEDED;
+    if(!exceeded) {
+      auto e = std::make_exception_ptr(Unreachable(fmt::format("Ping to {} failed, {} says: {}", iter->second.target.toString(),
+                                                               offender.toString(), strerror(see->ee_errno)), offender));
+      finish(sock, iter, e, Reply());
+      continue;
+    }
+    Reply r = makeReply(iter->second, msgh);
+    r.from = offender;
+    r.timeExceeded = true;
+    finish(sock, iter, nullptr, std::move(r));
+  }
+}
+
+void PingEngine::receive(Sock& sock)
+{
+  // send timestamps and errors first, they are about echo requests we might get the reply to below
+  receiveErrors(sock);
+
+  for(;;) {
+    char buf[1500];
+    union {
+      struct cmsghdr align;
+      char buf[256];
+    } cbuf;
+    ComboAddress from;
+    struct iovec iov{buf, sizeof(buf)};
+    struct msghdr msgh;
+    memset(&msgh, 0, sizeof(msgh));
+    msgh.msg_name = &from;
+    msgh.msg_namelen = sizeof(from);
+    msgh.msg_iov = &iov;
+    msgh.msg_iovlen = 1;
+    msgh.msg_control = cbuf.buf;
+    msgh.msg_controllen = sizeof(cbuf.buf);
+
+    ssize_t len = recvmsg(sock.fd, &msgh, MSG_DONTWAIT);
+    if(len < 0)
+      return;
+    if(len < 8) // ICMP header, without the IP header for these sockets
+      continue;
+    uint8_t type = buf[0];
+    if(type != (sock.family == AF_INET ? ICMP_ECHOREPLY : ICMP6_ECHO_REPLY))
+      continue;
+    uint16_t seq;
+    memcpy(&seq, buf + 6, 2);
+    auto iter = sock.pending.find(seq);
+    if(iter == sock.pending.end() || !sameAddress(from, iter->second.target))
+      continue; // late, or not for us
+
+    finish(sock, iter, nullptr, makeReply(iter->second, msgh));
+  }
+}
+
+void PingEngine::expire(time_point now)
+{
+  while(!d_deadlines.empty() && d_deadlines.begin()->first <= now) {
+    auto [sock, seq] = d_deadlines.begin()->second;
+    auto iter = sock->pending.find(seq);
+    auto e = std::make_exception_ptr(Timeout(fmt::format("Timeout waiting for ping response from {}", iter->second.target.toString())));
+    finish(*sock, iter, e, Reply());
+  }
+}
+
+void PingEngine::worker()
+{
+  for(;;) {
+    auto now = std::chrono::steady_clock::now();
+    {
+      std::lock_guard<std::mutex> l(d_lock);
+      if(d_stop)
+        break;
+      for(auto& e : d_queue) {
+        if(e.notBefore > now)
+          d_scheduled.insert({e.notBefore, std::move(e)});
+        else
+          d_outgoing.push_back(std::move(e));
+      }
+      d_queue.clear();
+    }
+    while(!d_scheduled.empty() && d_scheduled.begin()->first <= now) {
+      d_outgoing.push_back(std::move(d_scheduled.begin()->second));
+      d_scheduled.erase(d_scheduled.begin());
+    }
+    // one at a time, so we don't flood the network, or fill up the receive buffer with replies
+    while(!d_outgoing.empty() && d_nextSend <= now) {
+      send(d_outgoing.front(), now);
+      d_outgoing.pop_front();
+      d_nextSend = std::max(d_nextSend, now) + c_sendInterval;
+    }
+
+    std::vector<struct pollfd> pfds{{d_wakefd, POLLIN, 0}};
+    std::vector<Sock*> socks{nullptr};
+    for(auto& [key, s] : d_socks) {
+      if(!s->pending.empty()) {
+        pfds.push_back({s->fd, POLLIN, 0});
+        socks.push_back(s.get());
+      }
+    }
+
+    int timeout = -1;
+    auto until = [&](time_point t) {
+      auto left = t - std::chrono::steady_clock::now();
+      int msec = std::max(0.0, ceil(std::chrono::duration<double, std::milli>(left).count()));
+      if(timeout < 0 || msec < timeout)
+        timeout = msec;
+    };
+    if(!d_deadlines.empty())
+      until(d_deadlines.begin()->first);
+    if(!d_outgoing.empty())
+      until(d_nextSend);
+    if(!d_scheduled.empty())
+      until(d_scheduled.begin()->first);
+    if(poll(pfds.data(), pfds.size(), timeout) > 0) {
+      if(pfds[0].revents) {
+        uint64_t val;
+        ssize_t ret = read(d_wakefd, &val, sizeof(val));
+        (void)ret;
+      }
+      for(size_t n = 1; n < pfds.size(); ++n)
+        if(pfds[n].revents)
+          receive(*socks[n]);
+    }
+    expire(std::chrono::steady_clock::now());
+  }
+}
@@ -0,0 +1,146 @@
+#pragma once
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <time.h>
+#include "comboaddress.hh"
+
+/*!
+  @file
+  @brief Defines PingEngine, which sends the pings of all checkers from a few shared ICMP sockets
+
+  Instead of a socket per target and waiting for each target in turn, checkers hand a target
+  to the engine and get a future back. One I/O thread sends the echo requests, spaced a little
+  apart so a big list of targets does not go out as one burst, and collects the replies as they
+  come in. So a hundred targets take about one timeout, not a hundred.
+
+  There is one unprivileged ICMP socket (SOCK_DGRAM, IPPROTO_ICMP) per address family, local
+  address and DF setting. The kernel picks the echo identifier for such a socket and only
+  gives it the replies with that identifier, so replies get matched on sequence number and
+  source address. Round trip times come from the kernel send and receive timestamps (see
+  kerneltime.hh), so they do not include the time it took us to get the request out, or to get
+  to the reply. The user space number is there too, the difference is our own scheduling delay.
+
+  With a ttl, echo requests go out with that hop limit, from sockets with IP_RECVERR on. The
+  router where the hop limit runs out sends back a time exceeded, which the kernel puts on the
+  error queue with a copy of our echo request, so it gets matched like a reply. This is what
+  traceroute needs, and it means all hops of a path can be probed at the same time.
+
+  ```
+  auto reply = PingEngine::instance().submit(ComboAddress("9.9.9.9"), 1.0).get();
+  fmt::print("{} msec, ttl {}\n", reply.msec, reply.ttl);
+  ```
+*/
+
+class PingEngine
+{
+public:
+  struct Timeout : std::runtime_error
+  {
+    using std::runtime_error::runtime_error;
+  };
+
+  struct Reply
+  {
+    double msec; //!< from the kernel sending the echo request to the kernel receiving the reply
+    double userMsec; //!< from just before we sent the request to when we got around to the reply
+    bool kernel{false}; //!< if msec is from two kernel timestamps
+    int ttl{-1}; //!< hop limit for IPv6, -1 if the kernel did not tell us
+    ComboAddress from; //!< the target, or the router that said the hop limit ran out
+    bool timeExceeded{false};
+  };
+
+  //! An ICMP error other than time exceeded came back, like destination unreachable. Only with a ttl
+  struct Unreachable : std::runtime_error
+  {
+    Unreachable(const std::string& what, const ComboAddress& from_) : std::runtime_error(what), from(from_) {}
+    ComboAddress from; //!< who sent it
+  };
+
+  //! The engine and its I/O thread get started on first use
+  static PingEngine& instance();
+
+  /*! Pings target with size bytes of payload, delay seconds from now. The future gets the reply,
+      or a Timeout exception timeout seconds after sending. dontFragment only does something for IPv4.
+      A ttl over 0 sets the hop limit, see above */
+  std::future<Reply> submit(const ComboAddress& target, double timeout, size_t size = 56, bool dontFragment = true,
+                            std::optional<ComboAddress> local = std::nullopt, double delay = 0, int ttl = 0);
+
+  //! Called with the reply, or with an exception. Runs on the I/O thread, so keep it short
+  typedef std::function<void(std::exception_ptr, Reply&&)> callback_t;
+  void submit(const ComboAddress& target, double timeout, size_t size, bool dontFragment,
+              std::optional<ComboAddress> local, callback_t done, double delay = 0, int ttl = 0);
+
+  ~PingEngine();
+
+private:
+  PingEngine();
+  PingEngine(const PingEngine&) = delete;
+
+  typedef std::chrono::steady_clock::time_point time_point;
+  struct Echo
+  {
+    ComboAddress target;
+    std::optional<ComboAddress> local;
+    double timeout;
+    size_t size;
+    bool dontFragment;
+    int ttl;
+    callback_t done;
+    time_point notBefore;
+  };
+  struct Sock;
+  typedef std::multimap<time_point, std::pair<Sock*, uint16_t>> deadlines_t;
+  struct Pending
+  {
+    ComboAddress target;
+    callback_t done;
+    struct timespec sent; //!< CLOCK_REALTIME, like the kernel timestamps
+    time_point userSent;
+    struct timespec txKernel{0, 0}; //!< when the kernel sent it, if it told us
+    std::optional<uint32_t> txid; //!< number of the send timestamp
+    deadlines_t::iterator deadline;
+  };
+  struct Sock
+  {
+    ~Sock();
+    int fd{-1};
+    int family;
+    uint16_t seq{0}; //!< of the last echo request we sent
+    std::map<uint16_t, Pending> pending; //!< by sequence number
+    bool kernelTimestamps{false};
+    uint32_t sent{0}; //!< packets sent, which is how the kernel numbers the send timestamps
+    std::map<uint32_t, uint16_t> txids; //!< send timestamp number to sequence number
+  };
+
+  void worker();
+  void send(Echo& echo, time_point now);
+  void receive(Sock& sock);
+  void receiveErrors(Sock& sock);
+  static Reply makeReply(const Pending& p, const struct msghdr& msgh);
+  void finish(Sock& sock, std::map<uint16_t, Pending>::iterator iter, std::exception_ptr e, Reply&& r);
+  void expire(time_point now);
+  Sock& getSock(const Echo& echo);
+  void wake();
+
+  std::mutex d_lock;
+  std::deque<Echo> d_queue; //!< submitted, not yet picked up by the I/O thread
+  bool d_stop{false};
+  int d_wakefd; //!< eventfd that gets the I/O thread out of poll
+  // below is only touched by the I/O thread
+  std::multimap<time_point, Echo> d_scheduled; //!< submitted with a delay
+  std::deque<Echo> d_outgoing; //!< waiting for their turn to be sent
+  time_point d_nextSend;
+  std::map<std::tuple<int, std::string, bool, int>, std::unique_ptr<Sock>> d_socks; //!< by family, local address, DF & ttl
+  deadlines_t d_deadlines;
+  std::thread d_thread;
+};
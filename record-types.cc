@@ -125,9 +125,17 @@ void DNSStringReader::xfrTxt(std::string& txt)
   auto begin = ++d_iter;
   while(d_iter != d_string.end() && *d_iter != '"')
     ++d_iter;
-  if(*d_iter != '"')
+  if(d_iter == d_string.end())
     throw std::runtime_error("Text segment in DNS string should end with a quote");
   txt.assign(begin, d_iter);
+  ++d_iter;
+}
+
+bool DNSStringReader::eor()
+{
+  while(d_iter != d_string.end() && isspace(*d_iter))
+    d_iter++;
+  return d_iter == d_string.end();
 }
 
 AGen::AGen(DNSMessageReader& x)
@@ -336,6 +344,71 @@ std::string TXTGen::toString() const
 
 /////////////////////////////
 
+std::unique_ptr<RRGen> makeRRGen(DNSType type, const std::string& content)
+{
+  if(type == DNSType::A)
+    return AGen::make(content);
+  if(type == DNSType::AAAA)
+    return AAAAGen::make(content);
+
+  DNSStringReader dsr(content);
+  DNSName name;
+  switch(type) {
+  case DNSType::NS:
+    dsr.xfrName(name);
+    return NSGen::make(name);
+  case DNSType::CNAME:
+    dsr.xfrName(name);
+    return CNAMEGen::make(name);
+  case DNSType::PTR:
+    dsr.xfrName(name);
+    return PTRGen::make(name);
+  case DNSType::MX: {
+    uint16_t prio;
+    dsr.xfrUInt16(prio);
+    dsr.xfrName(name);
+    return MXGen::make(prio, name);
+  }
+  case DNSType::TXT: {
+    std::vector<std::string> txts;
+    do {
+      txts.emplace_back();
+      dsr.xfrTxt(txts.back());
+    } while(!dsr.eor());
+    return TXTGen::make(txts);
+  }
+  case DNSType::SOA:
+    return std::make_unique<SOAGen>(dsr);
+  case DNSType::SRV:
+    return std::make_unique<SRVGen>(dsr);
+  case DNSType::NAPTR:
+    return std::make_unique<NAPTRGen>(dsr);
+  default:
+    throw std::runtime_error(std::string("Can't parse the content of a ") + toString(type) + " record: '" + content + "'");
+  }
+}
+
+bool canMakeRRGen(DNSType type)
+{
+  switch(type) {
+  case DNSType::A:
+  case DNSType::AAAA:
+  case DNSType::NS:
+  case DNSType::CNAME:
+  case DNSType::PTR:
+  case DNSType::MX:
+  case DNSType::TXT:
+  case DNSType::SOA:
+  case DNSType::SRV:
+  case DNSType::NAPTR:
+    return true;
+  default:
+    return false;
+  }
+}
+
+/////////////////////////////
+
 void UnknownGen::toMessage(DNSMessageWriter& dmw)
 {
   dmw.xfrBlob(d_rr);
@@ -11,6 +11,16 @@ class DNSStringWriter;
 struct DNSStringReader
 {
   DNSStringReader(const std::string& str);
+  //! The generators take us by value, and d_iter has to point into our own copy
+  DNSStringReader(const DNSStringReader& rhs)
+    : d_string(rhs.d_string), d_iter(d_string.cbegin() + (rhs.d_iter - rhs.d_string.cbegin())) {}
+  DNSStringReader& operator=(const DNSStringReader& rhs)
+  {
+    auto pos = rhs.d_iter - rhs.d_string.cbegin();
+    d_string = rhs.d_string;
+    d_iter = d_string.cbegin() + pos;
+    return *this;
+  }
   void skipSpaces();
                                             
   void xfrName(DNSName& name);
@@ -19,6 +29,8 @@ struct DNSStringReader
   void xfrUInt16(uint16_t& v);
   void xfrUInt32(uint32_t& v);
   void xfrTxt(std::string& txt);
+  //! Are we at the end of the record? Skips trailing spaces
+  bool eor();
   std::string d_string;
   std::string::const_iterator d_iter;
 };
@@ -273,6 +285,11 @@ struct TXTGen : RRGen
   std::vector<std::string> d_txts;
 };
 
+//! Parses content in master file format, like "10 mx.example.com" for MX, into an RRGen
+std::unique_ptr<RRGen> makeRRGen(DNSType type, const std::string& content);
+//! If makeRRGen can parse the content of this type
+bool canMakeRRGen(DNSType type);
+
 //! This implements 'unknown record types'
 struct UnknownGen : RRGen
 {
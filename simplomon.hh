@@ -1,7 +1,9 @@
 #pragma once
+#include <array>
 #include <mutex>
 #include <regex>
 #include <string>
+#include <unordered_set>
 #include "record-types.hh"
 #include "sclasses.hh"
 #include "notifiers.hh"
@@ -11,6 +13,8 @@
 #include <fmt/ranges.h>
 #include "sqlwriter.hh"
 #include "peglib.h"
+#include "streamregex.hh"
+#include "compactzone.hh"
 
 extern sol::state g_lua;
 
@@ -126,7 +130,12 @@ private:
   DNSName d_qname;
   DNSType d_qtype;
   std::set<std::string> d_acceptable;
+  std::unordered_set<std::string> d_acceptableRdata; //!< d_acceptable, as DNSMessageView::getCanonicalRdata makes it
+  bool d_textMatch; //!< makeRRGen can't parse d_qtype, so compare d_acceptable with the text of the answers
+  std::string d_lastAnswers; //!< names and canonical rdata of the previous answer
+  std::string d_lastFinals;  //!< and how that looked as text
   bool d_rd = true;
+  std::string d_query; //!< built once, the DNSEngine puts in a new ID every time
 };
 
 class RRSIGChecker : public Checker
@@ -146,6 +155,7 @@ private:
   DNSName d_qname;
   DNSType d_qtype;
   int d_minDays=0;
+  std::string d_query;
 };
 
 
@@ -166,6 +176,57 @@ public:
 private:
   DNSName d_domain;
   std::set<ComboAddress> d_servers;
+  std::string d_query;
+};
+
+//! Checks SOA serials and SOA signatures of many zones on a few servers, with one query per zone per server
+class ZoneFleetChecker : public Checker
+{
+public:
+  ZoneFleetChecker(sol::table data);
+  CheckResult perform() override;
+  std::string getCheckerName() override { return "zonefleet"; }
+  std::string getDescription() override
+  {
+    std::vector<std::string> servers;
+    for(const auto& s : d_servers) servers.push_back(s.toStringWithPort());
+    return fmt::format("Zone fleet check, {} zones, servers {}, minDays: {}",
+                       d_zones.size(), servers, d_minDays);
+  }
+
+private:
+  std::vector<ComboAddress> d_servers;
+  std::vector<DNSName> d_zones;
+  std::vector<std::string> d_queries; //!< SOA with DO set, one per zone
+  int d_minDays = 7;
+  double d_qps = 1000;   //!< over all servers together
+  bool d_dnssec = true;  //!< if set, a SOA without RRSIG is an alert
+};
+
+//! Transfers a whole zone every so often, or just the changes, and checks all RRSIGs in it
+class ZoneSweepChecker : public Checker
+{
+public:
+  ZoneSweepChecker(sol::table data);
+  CheckResult perform() override;
+  std::string getCheckerName() override { return "zonesweep"; }
+  std::string getDescription() override
+  {
+    return fmt::format("Zone sweep, server {}, zone {}, minDays: {}",
+                       d_server.toStringWithPort(), d_zone.toString(), d_minDays);
+  }
+
+private:
+  ComboAddress d_server;
+  DNSName d_zone;
+  int d_minDays = 7;
+  int d_intervalMinutes = 60;
+  bool d_ixfr = true;
+  std::unique_ptr<DNSNode> d_tree; //!< our copy of the zone, kept up to date with IXFR
+  bool d_compact = false;
+  std::unique_ptr<CompactZone> d_compactZone; //!< instead of d_tree if d_compact, always gets a full transfer
+  time_t d_lastSweep = 0;
+  CheckResult d_lastResult; //!< the reasons are reported again until the next sweep, the results are not
 };
 
 
@@ -235,6 +296,37 @@ private:
   double d_timeout;
   size_t d_size;
   bool d_dontFragment;
+  int d_count;      //!< pings per server per round
+  double d_spacing; //!< seconds between the pings to one server
+  std::optional<double> d_maxLoss; //!< percent, if not set only losing every ping is an alert
+  std::optional<double> d_maxRtt;  //!< msec, compared to the average
+};
+
+class TraceRouteChecker : public Checker
+{
+public:
+  TraceRouteChecker(sol::table data);
+  CheckResult perform() override;
+  std::string getCheckerName() override { return "traceroute"; }
+  std::string getDescription() override
+  {
+    std::vector<std::string> servers;
+    for(const auto& s : d_servers) servers.push_back(s.toString());
+    return fmt::format("Traceroute check, servers {}", servers);
+  }
+
+private:
+  typedef std::vector<std::set<std::string>> path_t; //!< per hop, who answered
+  std::set<ComboAddress> d_servers;
+  std::optional<ComboAddress> d_localIP;
+  double d_timeout;
+  size_t d_size;
+  int d_maxHops;
+  int d_count;      //!< probes per hop per round
+  double d_spacing; //!< seconds between the probes to one hop
+  std::optional<double> d_maxLoss; //!< percent, of the probes that made it to the server
+  bool d_alertOnPathChange;
+  std::map<ComboAddress, path_t> d_paths; //!< the last path that made it to the server
 };
 
 
@@ -257,11 +349,22 @@ private:
   std::string d_url;
   int d_maxAgeMinutes = 0;
   unsigned int d_minBytes = 0;
+  size_t d_maxBytes = 0;
   unsigned int d_minCertDays = 14;
   std::optional<ComboAddress> d_serverIP, d_localIP4, d_localIP6;
   std::vector<ComboAddress> d_dns;
   std::string d_regexStr;
   std::regex d_regex;
+  std::optional<StreamRegex> d_sregex; //!< unset if the regex needs std::regex features
+  bool d_regexLineLocal = false;
+  bool d_reuse = false;
+  //! What we know about the content per address family, for conditional requests
+  struct Validator
+  {
+    std::string etag;
+    time_t filetime = -1;
+  };
+  std::array<Validator, 2> d_validators;
 
   std::string d_method;
   std::string d_agent="Mozilla/5.0 (Macintosh; Intel Mac OS X 10_15_7) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/114.0.0.0 Safari/537.36";
@@ -380,7 +483,12 @@ bool checkForWorkingIPv6();
 std::vector<ComboAddress> DNSResolveAt(const DNSName& name, const DNSType& type,
                                        const std::vector<ComboAddress>& servers,
                                        std::optional<ComboAddress> local4 = std::optional<ComboAddress>(),
-                                       std::optional<ComboAddress> local6 = std::optional<ComboAddress>()
+                                       std::optional<ComboAddress> local6 = std::optional<ComboAddress>(),
+                                       bool useCache = true //!< answers are kept for their TTL, within limits
                                        );
 std::vector<ComboAddress> getResolvers();
+//! Updates the smoothed round trip time of a resolver, an empty msec means it timed out
+void updateResolverStats(const ComboAddress& server, std::optional<double> msec);
+//! Resolvers in the order they get asked, fastest first, each with how many msec to wait for it before asking the next
+std::vector<std::pair<ComboAddress, double>> orderResolvers(const std::vector<ComboAddress>& resolvers);
 std::string getAgeDesc(time_t then);
@@ -0,0 +1,500 @@
+#include "streamregex.hh"
+#include <algorithm>
+#include <cstring>
+#include <bit>
+
+/*!
+  @file
+  @brief StreamRegex parser, Thompson NFA compiler and lazy DFA search
+*/
+
+namespace {
+constexpr size_t c_maxNodes = 20000;   //!< patterns that compile to more than this are not worth it
+constexpr int c_maxRepeat = 1000;      //!< largest n or m in {n,m}
+constexpr size_t c_maxStates = 2000;   //!< DFA states we cache per search, about 2MB
+}
+
+//! The parsed pattern, which gets compiled to the NFA
+struct StreamRegex::Ast
+{
+  enum class Kind { Set, Cat, Alt, Repeat, Bol, Eol, Empty };
+  explicit Ast(Kind k) : kind(k) {}
+  Kind kind;
+  std::vector<std::unique_ptr<Ast>> kids;
+  byteset_t set{};
+  int min{0}, max{-1}; //!< for Repeat, -1 is unbounded
+};
+
+//! Recursive descent parser for our ECMAScript subset
+struct StreamRegex::Parser
+{
+  explicit Parser(const std::string& pattern) : d_p(pattern) {}
+
+  std::unique_ptr<Ast> parseAlt()
+  {
+    auto first = parseCat();
+    if(!more() || peek() != '|')
+      return first;
+    auto ret = std::make_unique<Ast>(Ast::Kind::Alt);
+    ret->kids.push_back(std::move(first));
+    while(more() && peek() == '|') {
+      get();
+      ret->kids.push_back(parseCat());
+    }
+    return ret;
+  }
+
+  std::unique_ptr<Ast> parseCat()
+  {
+    auto ret = std::make_unique<Ast>(Ast::Kind::Cat);
+    while(more() && peek() != '|' && peek() != ')')
+      ret->kids.push_back(parseRepeat());
+    if(ret->kids.empty())
+      return std::make_unique<Ast>(Ast::Kind::Empty);
+    if(ret->kids.size() == 1)
+      return std::move(ret->kids.front());
+    return ret;
+  }
+
+  std::unique_ptr<Ast> parseRepeat()
+  {
+    auto atom = parseAtom();
+    if(!more())
+      return atom;
+    int min, max;
+    char c = peek();
+    if(c == '*')      { min = 0; max = -1; }
+    else if(c == '+') { min = 1; max = -1; }
+    else if(c == '?') { min = 0; max = 1; }
+    else if(c == '{') {
+      get();
+      min = max = getNumber();
+      if(more() && peek() == ',') {
+        get();
+        max = (more() && peek() == '}') ? -1 : getNumber();
+      }
+      if(!more() || peek() != '}' || (max >= 0 && max < min))
+        throw Unsupported("Badly formed {} quantifier");
+    }
+    else
+      return atom;
+    get();
+    if(more() && peek() == '?') // lazy, which makes no difference for finding out if there is a match
+      get();
+
+    auto ret = std::make_unique<Ast>(Ast::Kind::Repeat);
+    ret->min = min;
+    ret->max = max;
+    ret->kids.push_back(std::move(atom));
+    return ret;
+  }
+
+  std::unique_ptr<Ast> parseAtom()
+  {
+    char c = get();
+    if(c == '(') {
+      if(more() && peek() == '?') {
+        get();
+        if(!more() || get() != ':')
+          throw Unsupported("Lookaheads are not supported");
+      }
+      auto ret = parseAlt();
+      if(!more() || get() != ')')
+        throw Unsupported("Unbalanced parentheses");
+      return ret;
+    }
+    if(c == '^')
+      return std::make_unique<Ast>(Ast::Kind::Bol);
+    if(c == '$')
+      return std::make_unique<Ast>(Ast::Kind::Eol);
+
+    auto ret = std::make_unique<Ast>(Ast::Kind::Set);
+    if(c == '.') {
+      fill(ret->set);
+      clear(ret->set, '\n');
+      clear(ret->set, '\r');
+    }
+    else if(c == '[')
+      parseClass(ret->set);
+    else if(c == '\\')
+      parseEscape(ret->set, false);
+    else if(c == '*' || c == '+' || c == '?' || c == '{' || c == '}' || c == ']' || c == ')')
+      throw Unsupported(std::string("Unexpected '")+c+"'");
+    else
+      set(ret->set, c);
+    return ret;
+  }
+
+  void parseClass(byteset_t& ret)
+  {
+    bool negate = false;
+    if(more() && peek() == '^') {
+      get();
+      negate = true;
+    }
+    for(;;) {
+      if(!more())
+        throw Unsupported("Unterminated character class");
+      char c = get();
+      if(c == ']')
+        break;
+      if(c == '[' && more() && (peek() == ':' || peek() == '=' || peek() == '.'))
+        throw Unsupported("POSIX character classes are not supported");
+
+      byteset_t atom{};
+      if(c == '\\') {
+        if(!parseEscape(atom, true)) { // \d and friends can't be part of a range
+          for(int n = 0; n < 4; ++n)
+            ret[n] |= atom[n];
+          continue;
+        }
+        c = firstSet(atom);
+      }
+      if(more(2) && peek() == '-' && d_p[d_pos+1] != ']') {
+        get();
+        char to = get();
+        if(to == '\\') {
+          byteset_t end{};
+          if(!parseEscape(end, true))
+            throw Unsupported("Character class range ends in a class");
+          to = firstSet(end);
+        }
+        if((uint8_t)c >= 0x80 || (uint8_t)to >= 0x80 || (uint8_t)to < (uint8_t)c)
+          throw Unsupported("Unsupported character class range");
+        for(int n = (uint8_t)c; n <= (uint8_t)to; ++n)
+          set(ret, n);
+      }
+      else
+        set(ret, c);
+    }
+    if(negate)
+      for(auto& w : ret)
+        w = ~w;
+  }
+
+  //! Parses what comes after a backslash, returns true if it was a single character
+  bool parseEscape(byteset_t& ret, bool inClass)
+  {
+    if(!more())
+      throw Unsupported("Trailing backslash");
+    char c = get();
+    switch(c) {
+    case 'd': case 'D':
+      for(char n = '0'; n <= '9'; ++n)
+        set(ret, n);
+      break;
+    case 'w': case 'W':
+      for(int n = 0; n < 256; ++n)
+        if(isalnum(n) || n == '_')
+          set(ret, n);
+      break;
+    case 's': case 'S':
+      for(char n : {' ', '\t', '\n', '\v', '\f', '\r'})
+        set(ret, n);
+      break;
+    case 'n': set(ret, '\n'); return true;
+    case 'r': set(ret, '\r'); return true;
+    case 't': set(ret, '\t'); return true;
+    case 'f': set(ret, '\f'); return true;
+    case 'v': set(ret, '\v'); return true;
+    case 'x': set(ret, getHex(2)); return true;
+    case 'u': {
+      int val = getHex(4);
+      if(val >= 0x80)
+        throw Unsupported("\\u escapes beyond ASCII are not supported");
+      set(ret, val);
+      return true;
+    }
+    case 'b':
+      if(!inClass)
+        throw Unsupported("Word boundaries are not supported");
+      set(ret, '\b');
+      return true;
+    case '0':
+      if(more() && isdigit(peek()))
+        throw Unsupported("Octal escapes are not supported");
+      set(ret, '\0');
+      return true;
+    default:
+      if(isalnum(c)) // backreferences, \B, \c and things we don't know
+        throw Unsupported(std::string("Unsupported escape \\")+c);
+      set(ret, c);
+      return true;
+    }
+    if(isupper(c))
+      for(auto& w : ret)
+        w = ~w;
+    return false;
+  }
+
+  int getNumber()
+  {
+    if(!more() || !isdigit(peek()))
+      throw Unsupported("Expected a number in {} quantifier");
+    int ret = 0;
+    while(more() && isdigit(peek())) {
+      ret = ret * 10 + (get() - '0');
+      if(ret > c_maxRepeat)
+        throw Unsupported("Repeat count too large");
+    }
+    return ret;
+  }
+
+  int getHex(int digits)
+  {
+    int ret = 0;
+    for(int n = 0; n < digits; ++n) {
+      if(!more() || !isxdigit(peek()))
+        throw Unsupported("Badly formed hex escape");
+      char c = tolower(get());
+      ret = ret * 16 + (isdigit(c) ? c - '0' : c - 'a' + 10);
+    }
+    return ret;
+  }
+
+  static void set(byteset_t& s, uint8_t c) { s[c >> 6] |= 1ULL << (c & 63); }
+  static void clear(byteset_t& s, uint8_t c) { s[c >> 6] &= ~(1ULL << (c & 63)); }
+  static void fill(byteset_t& s) { s.fill(~0ULL); }
+  static char firstSet(const byteset_t& s)
+  {
+    for(int n = 0; n < 4; ++n)
+      if(s[n])
+        return (char)(n * 64 + std::countr_zero(s[n]));
+    return 0;
+  }
+
+  //! If every match of ast starts with a literal string, this collects it
+  static bool collectPrefix(const Ast& ast, std::string& prefix)
+  {
+    using Kind = Ast::Kind;
+    if(ast.kind == Kind::Set) {
+      int bits = 0;
+      for(auto w : ast.set)
+        bits += std::popcount(w);
+      if(bits != 1)
+        return false;
+      prefix.append(1, firstSet(ast.set));
+      return true;
+    }
+    if(ast.kind == Kind::Cat) {
+      for(const auto& k : ast.kids)
+        if(!collectPrefix(*k, prefix))
+          return false;
+      return true;
+    }
+    return ast.kind == Kind::Empty;
+  }
+
+  bool more(size_t n = 1) const { return d_pos + n <= d_p.size(); }
+  char peek() const { return d_p[d_pos]; }
+  char get() { return d_p.at(d_pos++); }
+
+  const std::string& d_p;
+  size_t d_pos{0};
+};
+
+StreamRegex::StreamRegex(const std::string& pattern)
+{
+  Parser p(pattern);
+  auto ast = p.parseAlt();
+  if(p.more()) // a stray ')'
+    throw Unsupported("Unbalanced parentheses");
+
+  d_start = compile(*ast, addNode(Op::Match));
+  Parser::collectPrefix(*ast, d_prefix);
+}
+
+int StreamRegex::addNode(Op op, int out, int out1, int set)
+{
+  if(d_prog.size() >= c_maxNodes)
+    throw Unsupported("Pattern too large");
+  d_prog.push_back({op, out, out1, set});
+  return d_prog.size() - 1;
+}
+
+//! Compiles ast so that it continues to 'next' after matching, returns the node to start at
+int StreamRegex::compile(const Ast& ast, int next)
+{
+  switch(ast.kind) {
+  case Ast::Kind::Set:
+    d_sets.push_back(ast.set);
+    return addNode(Op::Set, next, -1, d_sets.size() - 1);
+  case Ast::Kind::Cat:
+    for(auto iter = ast.kids.rbegin(); iter != ast.kids.rend(); ++iter)
+      next = compile(**iter, next);
+    return next;
+  case Ast::Kind::Alt: {
+    int ret = compile(*ast.kids.back(), next);
+    for(auto iter = ast.kids.rbegin() + 1; iter != ast.kids.rend(); ++iter)
+      ret = addNode(Op::Split, compile(**iter, next), ret);
+    return ret;
+  }
+  case Ast::Kind::Repeat: {
+    const auto& kid = *ast.kids.front();
+    int ret;
+    if(ast.max < 0) { // loop back to a split that either goes around again or leaves
+      ret = addNode(Op::Split, -1, next);
+      d_prog[ret].out = compile(kid, ret);
+    }
+    else { // optional copies, each one only reachable through the previous
+      ret = next;
+      for(int n = ast.min; n < ast.max; ++n)
+        ret = addNode(Op::Split, compile(kid, ret), next);
+    }
+    for(int n = 0; n < ast.min; ++n)
+      ret = compile(kid, ret);
+    return ret;
+  }
+  case Ast::Kind::Bol:
+    return addNode(Op::Bol, next);
+  case Ast::Kind::Eol:
+    return addNode(Op::Eol, next);
+  case Ast::Kind::Empty:
+    break;
+  }
+  return next;
+}
+
+/* follows the epsilon edges from seeds, which gets used as scratch space.
+   What remains are the nodes that consume a byte, Match, and Eol nodes that still need the end of input */
+void StreamRegex::closure(std::vector<int>& seeds, bool atStart, bool atEnd, std::vector<int>& ret) const
+{
+  std::vector<bool> seen(d_prog.size());
+  ret.clear();
+  while(!seeds.empty()) {
+    int n = seeds.back();
+    seeds.pop_back();
+    if(n < 0 || seen[n])
+      continue;
+    seen[n] = true;
+    const auto& node = d_prog[n];
+    switch(node.op) {
+    case Op::Split:
+      seeds.push_back(node.out1);
+      seeds.push_back(node.out);
+      break;
+    case Op::Bol:
+      if(atStart)
+        seeds.push_back(node.out);
+      break;
+    case Op::Eol:
+      if(atEnd)
+        seeds.push_back(node.out);
+      else
+        ret.push_back(n);
+      break;
+    case Op::Set:
+    case Op::Match:
+      ret.push_back(n);
+      break;
+    }
+  }
+  std::sort(ret.begin(), ret.end());
+}
+
+bool StreamRegex::search(std::string_view str) const
+{
+  Search s(*this);
+  s.feed(str);
+  return s.finish();
+}
+
+StreamRegex::Search::Search(const StreamRegex& re) : d_re(re)
+{
+  resetCache();
+  std::vector<int> seeds{d_re.d_start}, nodes;
+  d_re.closure(seeds, true, false, nodes);
+  d_cur = intern(std::move(nodes));
+  d_matched = d_match[d_cur];
+}
+
+void StreamRegex::Search::resetCache()
+{
+  d_index.clear();
+  d_nodes.clear();
+  d_trans.clear();
+  d_match.clear();
+  d_dead = intern({});
+  // where we are when no match is in progress. For ^ patterns, that is the dead state
+  std::vector<int> seeds{d_re.d_start}, nodes;
+  d_re.closure(seeds, false, false, nodes);
+  d_idle = intern(std::move(nodes));
+}
+
+int StreamRegex::Search::intern(std::vector<int>&& nodes)
+{
+  if(auto iter = d_index.find(nodes); iter != d_index.end())
+    return iter->second;
+  int ret = d_nodes.size();
+  d_match.push_back(std::any_of(nodes.begin(), nodes.end(), [this](int n) { return d_re.d_prog[n].op == Op::Match; }));
+  d_index.emplace(nodes, ret);
+  d_nodes.push_back(std::move(nodes));
+  d_trans.resize(d_trans.size() + 256, -1);
+  return ret;
+}
+
+//! Computes and caches where the DFA goes from state on c
+int StreamRegex::Search::step(int state, uint8_t c)
+{
+  std::vector<int> seeds{d_re.d_start}, nodes; // a new match can start at every position
+  for(int n : d_nodes[state]) {
+    const auto& node = d_re.d_prog[n];
+    if(node.op == Op::Set && d_re.inSet(node.set, c))
+      seeds.push_back(node.out);
+  }
+  d_re.closure(seeds, false, false, nodes);
+
+  if(d_nodes.size() >= c_maxStates) { // keep memory bounded, and start learning again
+    resetCache();
+    return intern(std::move(nodes));
+  }
+  int ret = intern(std::move(nodes));
+  d_trans[state * 256 + c] = ret;
+  return ret;
+}
+
+bool StreamRegex::Search::feed(std::string_view data)
+{
+  if(d_matched)
+    return true;
+  const auto& prefix = d_re.d_prefix;
+  const uint8_t* p = (const uint8_t*)data.data();
+  size_t len = data.size();
+  for(size_t i = 0; i < len && d_cur != d_dead;) {
+    if(d_cur == d_idle && !prefix.empty()) {
+      // nothing in progress, so the next match can only start where the prefix does
+      auto hit = (const uint8_t*)memmem(p + i, len - i, prefix.c_str(), prefix.size());
+      if(hit)
+        i = hit - p;
+      else { // what remains might be the start of a prefix that ends in the next chunk
+        i = len - std::min(len - i, prefix.size() - 1);
+        if(i == len)
+          break;
+      }
+    }
+    int next = d_trans[d_cur * 256 + p[i]];
+    if(next < 0)
+      next = step(d_cur, p[i]);
+    d_cur = next;
+    ++i;
+    if(d_match[d_cur]) {
+      d_matched = true;
+      break;
+    }
+  }
+  d_pos += len;
+  return d_matched;
+}
+
+bool StreamRegex::Search::finish()
+{
+  if(d_matched)
+    return true;
+  std::vector<int> seeds, nodes;
+  for(int n : d_nodes[d_cur])
+    if(d_re.d_prog[n].op == Op::Eol)
+      seeds.push_back(n);
+  d_re.closure(seeds, d_pos == 0, true, nodes);
+  d_matched = std::any_of(nodes.begin(), nodes.end(), [this](int n) { return d_re.d_prog[n].op == Op::Match; });
+  return d_matched;
+}
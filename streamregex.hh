@@ -0,0 +1,101 @@
+#pragma once
+#include <array>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/*!
+  @file
+  @brief Defines StreamRegex, a linear time regular expression search that works on streamed input
+
+  std::regex backtracks, recurses per character and can take exponential time on the wrong
+  pattern. StreamRegex compiles the pattern to a Thompson NFA and runs it as a lazily built DFA,
+  so every input byte is looked at once, and a search can be fed data in chunks.
+
+  It supports the ECMAScript subset that makes sense for content checks: literals, ., character
+  classes, \\d \\w \\s and friends, groups, alternation, ^, $ and the * + ? {n,m} quantifiers.
+  Lazy quantifiers are accepted but behave like greedy ones, since we only report *if* there
+  is a match. Anything else (backreferences, lookaheads, \\b) throws Unsupported, so the caller
+  can fall back to std::regex.
+
+  ```
+  StreamRegex re("Europe");
+  StreamRegex::Search s(re);
+  s.feed("hello Eur");
+  if(s.feed("ope"))
+    ; // matched
+  ```
+*/
+
+class StreamRegex
+{
+public:
+  struct Unsupported : std::runtime_error
+  {
+    using std::runtime_error::runtime_error;
+  };
+
+  explicit StreamRegex(const std::string& pattern);
+
+  //! Convenience function, is there a match for us in str
+  bool search(std::string_view str) const;
+
+  //! The literal every match starts with, used to skip ahead quickly
+  const std::string& getPrefix() const { return d_prefix; }
+
+  //! Incremental search, one per input being searched. The StreamRegex must outlive it
+  class Search
+  {
+  public:
+    explicit Search(const StreamRegex& re);
+    //! Feed the next chunk of input, returns true once a match has been seen
+    bool feed(std::string_view data);
+    //! Call at the end of input, returns true if there was a match
+    bool finish();
+    bool matched() const { return d_matched; }
+    //! No match is possible anymore, whatever comes next
+    bool dead() const { return d_cur == d_dead; }
+  private:
+    int intern(std::vector<int>&& nodes);
+    int step(int state, uint8_t c);
+    void resetCache();
+
+    const StreamRegex& d_re;
+    std::map<std::vector<int>, int> d_index;
+    std::vector<std::vector<int>> d_nodes; //!< per DFA state, the NFA nodes it stands for
+    std::vector<int> d_trans;              //!< 256 entries per DFA state, -1 means not computed yet
+    std::vector<bool> d_match;
+    int d_cur{-1}, d_idle{-1}, d_dead{-1};
+    uint64_t d_pos{0};
+    bool d_matched{false};
+  };
+
+private:
+  enum class Op : uint8_t { Set, Split, Match, Bol, Eol };
+  struct Node
+  {
+    Op op;
+    int out{-1}, out1{-1};
+    int set{-1}; //!< index in d_sets, for Op::Set
+  };
+  struct Ast;
+  struct Parser;
+  typedef std::array<uint64_t, 4> byteset_t;
+
+  int compile(const Ast& ast, int next);
+  int addNode(Op op, int out=-1, int out1=-1, int set=-1);
+  void closure(std::vector<int>& seeds, bool atStart, bool atEnd, std::vector<int>& ret) const;
+  bool inSet(int set, uint8_t c) const
+  {
+    return (d_sets[set][c >> 6] >> (c & 63)) & 1;
+  }
+
+  std::vector<Node> d_prog;
+  std::vector<byteset_t> d_sets;
+  int d_start{-1};
+  std::string d_prefix;
+};
@@ -1,58 +1,180 @@
 #include "simplomon.hh"
+#include "dnsengine.hh"
 #include <fstream>
+#include <condition_variable>
+#include <deque>
+#include <future>
+#include <mutex>
+#include <sys/inotify.h>
+#include <libgen.h>
 
 using namespace std;
 
-static DNSMessageReader sendQuery(const vector<ComboAddress>& resolvers, DNSName dn, DNSType dt, std::optional<ComboAddress> local4 = std::optional<ComboAddress>(), std::optional<ComboAddress> local6 = std::optional<ComboAddress>())
+namespace {
+//! Smoothed round trip time per resolver, as in RFC 6298, in milliseconds
+struct ResolverStats
+{
+  double srtt{0}, rttvar{0};
+  bool known{false};
+};
+std::mutex s_resolverStatsLock;
+std::map<ComboAddress, ResolverStats> s_resolverStats;
+
+constexpr double c_queryTimeout = 1.5;    //!< seconds, per attempt
+constexpr double c_unknownRTT = 250;      //!< msec, for resolvers we have not heard from yet
+constexpr double c_minHedge = 10, c_maxHedge = 1500; //!< msec
+constexpr int c_attempts = 3;             //!< per resolver
+
+//! Answers and failures of the resolvers we are racing, by their place in the order, filled from the DNS engine thread
+struct Race
+{
+  std::mutex lock;
+  std::condition_variable cv;
+  std::deque<std::pair<size_t, std::string>> answers;
+  std::deque<std::pair<size_t, std::exception_ptr>> failures;
+  int outstanding{0};
+};
+}
+
+void updateResolverStats(const ComboAddress& server, std::optional<double> msec)
+{
+  std::lock_guard<std::mutex> l(s_resolverStatsLock);
+  auto& st = s_resolverStats[server];
+  if(!msec) { // a timeout, so we try others first next time, but not forever
+    st.srtt = std::min(std::max(st.srtt * 2, c_unknownRTT), c_queryTimeout * 1000);
+    st.known = true;
+  }
+  else if(!st.known) {
+    st.srtt = *msec;
+    st.rttvar = *msec / 2;
+    st.known = true;
+  }
+  else {
+    st.rttvar = 0.75 * st.rttvar + 0.25 * fabs(st.srtt - *msec);
+    st.srtt = 0.875 * st.srtt + 0.125 * *msec;
+  }
+}
+
+vector<pair<ComboAddress, double>> orderResolvers(const vector<ComboAddress>& resolvers)
+{
+  vector<tuple<double, ComboAddress, double>> order; // expected RTT, server, hedge delay
+  {
+    std::lock_guard<std::mutex> l(s_resolverStatsLock);
+    for(const auto& server : resolvers) {
+      auto iter = s_resolverStats.find(server);
+      if(iter == s_resolverStats.end() || !iter->second.known)
+        order.push_back({c_unknownRTT, server, c_unknownRTT});
+      else
+        order.push_back({iter->second.srtt, server,
+                         std::clamp(iter->second.srtt + 4 * iter->second.rttvar, c_minHedge, c_maxHedge)});
+    }
+  }
+  std::stable_sort(order.begin(), order.end(), [](const auto& a, const auto& b) { return get<0>(a) < get<0>(b); });
+  vector<pair<ComboAddress, double>> ret;
+  for(const auto& o : order)
+    ret.push_back({get<1>(o), get<2>(o)});
+  return ret;
+}
+
+/* Asks the resolver with the lowest smoothed RTT first. If it has not answered within its
+   srtt + 4*rttvar, the next best one that was not asked yet gets asked too, and so on, and the
+   first useful answer wins. A resolver only gets asked again once its previous query failed,
+   timed out or got a useless answer, up to three times, like before */
+static string sendQuery(const vector<ComboAddress>& resolvers, DNSName dn, DNSType dt, std::optional<ComboAddress> local4 = std::optional<ComboAddress>(), std::optional<ComboAddress> local6 = std::optional<ComboAddress>())
 {
   DNSMessageWriter dmw(dn, dt);
   
   dmw.dh.rd = true;
-  dmw.randomizeID();
   dmw.setEDNS(4000, false);
-  for(int n=0; n < 3; ++n) {
-    for(const auto& server: resolvers) {
+  string query = dmw.serialize();
+
+  auto order = orderResolvers(resolvers); // server, hedge delay
+  auto race = std::make_shared<Race>();
+  vector<int> attempts(order.size());
+  vector<bool> busy(order.size());
+  size_t asked = 0; // the first this many resolvers were asked at least once
+  double hedge = c_maxHedge;
+  auto launch = [&](size_t n) { // call with race->lock held
+    const auto& [server, h] = order[n];
+    attempts[n]++;
+    busy[n] = true;
+    hedge = h;
+    if(n == asked)
+      asked++;
+    std::optional<ComboAddress> local = server.sin4.sin_family == AF_INET ? local4 : local6;
+    race->outstanding++;
+    DNSEngine::instance().submit(query, server, c_queryTimeout, local,
+                                 [race, n, server](std::exception_ptr e, DNSEngine::Answer&& a) {
+      updateResolverStats(server, e ? std::optional<double>() : a.msec);
+      std::lock_guard<std::mutex> l(race->lock);
+      race->outstanding--;
+      if(e)
+        race->failures.push_back({n, e});
+      else
+        race->answers.push_back({n, std::move(a.packet)});
+      race->cv.notify_one();
+    });
+  };
+  // a resolver that was not asked yet, otherwise one that is not waiting for an answer
+  auto pick = [&]() -> std::optional<size_t> {
+    if(asked < order.size())
+      return asked;
+    for(size_t n = 0; n < order.size(); ++n)
+      if(!busy[n] && attempts[n] < c_attempts)
+        return n;
+    return std::nullopt;
+  };
+
+  std::unique_lock<std::mutex> l(race->lock);
+  for(;;) {
+    bool failed = false;
+    while(!race->failures.empty()) {
+      auto [n, e] = race->failures.front();
+      race->failures.pop_front();
+      busy[n] = false;
+      failed = true;
       try {
-	Socket sock(server.sin4.sin_family, SOCK_DGRAM);
-        
-        if(server.sin4.sin_family == AF_INET && local4) {
-          local4->setPort(0);
-          SBind(sock, *local4);
-        }
-        if(server.sin4.sin_family == AF_INET6 && local6) {
-          local6->setPort(0);
-          SBind(sock, *local6);
+        std::rethrow_exception(e);
+      }
+      catch(DNSEngine::Timeout&) {
+        cout<<"Timeout asking "<<order[n].first.toString()<<" for "<<dn<<" "<<dt<<", trying again"<<endl;
+      }
+      catch(std::exception& ex) {
+        cout<<"Error asking "<<order[n].first.toString()<<" for "<<dn<<" "<<dt<<": "<<ex.what()<<", trying again"<<endl;
+      }
+    }
+    while(!race->answers.empty()) {
+      auto [n, resp] = std::move(race->answers.front());
+      race->answers.pop_front();
+      busy[n] = false;
+      try {
+        DNSMessageView dmv(resp);
+        if((RCode)dmv.dh.rcode != RCode::Noerror && (RCode)dmv.dh.rcode != RCode::Nxdomain ) {
+          //	  cout<<"Server gave us an inconclusive RCode ("<<(RCode)dmv.dh.rcode<<"), ignoring this response"<<endl;
+          failed = true;
+          continue;
         }
-
-	SetNonBlocking(sock, true);
-	SConnect(sock, server);
-	SWrite(sock, dmw.serialize());
-	double timeout=1.5;
-	if(!waitForData(sock, &timeout)) {
-	  cout<<"Timeout asking "<<server.toString()<<" for "<<dn<<" "<<dt<<", trying again"<<endl;
-	  continue;
-	}
-	
-	ComboAddress rem=server;
-	string resp = SRecvfrom(sock, 65535, rem);
-	// these will be identical because of the connect above
-	DNSMessageReader dmr(resp);
-	if((RCode)dmr.dh.rcode != RCode::Noerror && (RCode)dmr.dh.rcode != RCode::Nxdomain ) {
-          //	  cout<<"Server gave us an inconclusive RCode ("<<(RCode)dmr.dh.rcode<<"), ignoring this response"<<endl;
-	  continue;
-	}
-	
-	if(dmr.dh.tc) {
-          throw std::runtime_error(fmt::format("Needed to do TCP DNS for {}|{} which we can't",
-                                               dn.toString(), toString(dt))
-                                   );
-	  // shit
-	}
-	else
-	  return dmr;
+        return std::move(resp); // the engine already asked again over TCP if this was truncated
       }
-      catch(...){} 
+      catch(...) {
+        failed = true;
+      }
+    }
+    // nothing to wait for, or one less, so no need to wait before asking the next one
+    if(!race->outstanding || failed) {
+      if(auto n = pick()) {
+        launch(*n);
+        continue;
+      }
+      if(!race->outstanding)
+        break;
+    }
+    if(asked < order.size()) {
+      if(race->cv.wait_for(l, std::chrono::microseconds((int64_t)(hedge * 1000))) == std::cv_status::timeout)
+        launch(asked);
     }
+    else
+      race->cv.wait(l);
   }
   throw std::runtime_error(fmt::format("No DNS server could be reached or responded trying to resolve '{}|{}'",
                                        dn.toString(), toString(dt))
@@ -60,7 +182,7 @@ static DNSMessageReader sendQuery(const vector<ComboAddress>& resolvers, DNSName
 }
 
 
-vector<ComboAddress> getResolvers()
+static vector<ComboAddress> readResolvers()
 {
   ifstream ifs("/etc/resolv.conf");
   
@@ -95,29 +217,163 @@ vector<ComboAddress> getResolvers()
   return ret;
 }
 
+namespace {
+/* Watches the directory of /etc/resolv.conf, and of where it links to. Editors and resolvconf
+   replace the file instead of writing to it, so watching the file itself would miss that */
+struct ResolverWatch
+{
+  ResolverWatch()
+  {
+    d_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if(d_fd < 0)
+      return;
+    uint32_t mask = IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_DELETE;
+    inotify_add_watch(d_fd, "/etc", mask);
+    if(char* real = realpath("/etc/resolv.conf", nullptr)) {
+      string dir(real);
+      free(real);
+      dir = dirname(dir.data());
+      if(dir != "/etc")
+        inotify_add_watch(d_fd, dir.c_str(), mask);
+    }
+  }
+  ~ResolverWatch()
+  {
+    if(d_fd >= 0)
+      close(d_fd);
+  }
+  //! true if something in the watched directories changed since last time we asked
+  bool changed()
+  {
+    if(d_fd < 0)
+      return true; // no inotify, so we can't know
+    bool ret = false;
+    char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    while(read(d_fd, buf, sizeof(buf)) > 0)
+      ret = true;
+    return ret;
+  }
+  int d_fd;
+};
+}
+
+vector<ComboAddress> getResolvers()
+{
+  static std::mutex s_lock;
+  static ResolverWatch s_watch;
+  static std::optional<vector<ComboAddress>> s_resolvers;
+
+  std::lock_guard<std::mutex> l(s_lock);
+  if(s_watch.changed() || !s_resolvers)
+    s_resolvers = readResolvers();
+  return *s_resolvers;
+}
+
+static std::vector<ComboAddress> DNSResolveAtUncached(const DNSName& name, const DNSType& type,
+                                                      const std::vector<ComboAddress>& servers,
+                                                      std::optional<ComboAddress> local4,
+                                                      std::optional<ComboAddress> local6,
+                                                      uint32_t& minTTL)
+{
+  string resp = sendQuery(servers, name, type, local4, local6);
+  DNSMessageView dmv(resp);
+  vector<ComboAddress> ret;  
+  minTTL = std::numeric_limits<uint32_t>::max();
+  // only the addresses we want get parsed
+  for(const auto& rr : dmv) {
+    if(rr.section == DNSSection::Answer && rr.type == type) {
+      auto content = dmv.getContent(rr);
+      if(type == DNSType::A)
+        ret.push_back(dynamic_cast<AGen*>(content.get())->getIP());
+      else if(type == DNSType::AAAA)
+        ret.push_back(dynamic_cast<AAAAGen*>(content.get())->getIP());
+      minTTL = min(minTTL, rr.ttl);
+    }
+    else if(rr.section == DNSSection::Authority && rr.type == DNSType::SOA && ret.empty()) {
+      // how long we may remember there is nothing, RFC 2308 section 5
+      auto soa = dmv.getContent(rr);
+      minTTL = min({minTTL, rr.ttl, dynamic_cast<SOAGen*>(soa.get())->d_minimum});
+    }
+  }
+  return ret;
+}
+
+namespace {
+constexpr uint32_t c_minCacheTTL = 5;   //!< so a zero TTL does not send every probe to the resolver
+constexpr uint32_t c_maxCacheTTL = 300; //!< so we notice renumbering, even with silly TTLs
+constexpr uint32_t c_negCacheTTL = 30;  //!< for empty answers without a SOA record
+
+struct DNSCacheEntry
+{
+  vector<ComboAddress> addresses;
+  time_t expire;
+};
+std::mutex s_dnsCacheLock;
+std::map<string, DNSCacheEntry> s_dnsCache;
+std::map<string, std::shared_future<vector<ComboAddress>>> s_dnsInflight;
+}
+
 std::vector<ComboAddress> DNSResolveAt(const DNSName& name, const DNSType& type,
                                        const std::vector<ComboAddress>& servers,
                                        std::optional<ComboAddress> local4,
-                                       std::optional<ComboAddress> local6
+                                       std::optional<ComboAddress> local6,
+                                       bool useCache
                                        )
 {
-  DNSMessageReader dmr = sendQuery(servers, name, type, local4, local6);
-  DNSName dn;
-  DNSType dt;
-  dmr.getQuestion(dn, dt);
-  vector<ComboAddress> ret;  
-  std::unique_ptr<RRGen> rr;
-  DNSSection rrsection;
   uint32_t ttl;
-  while(dmr.getRR(rrsection, dn, dt, ttl, rr)) {
-    if(rrsection == DNSSection::Answer && dt == type) {
-      if(type == DNSType::A)
-        ret.push_back(dynamic_cast<AGen*>(rr.get())->getIP());
-      else if(type == DNSType::AAAA)
-        ret.push_back(dynamic_cast<AAAAGen*>(rr.get())->getIP());
+  if(!useCache)
+    return DNSResolveAtUncached(name, type, servers, local4, local6, ttl);
+
+  string key = name.toString();
+  for(auto& c : key)
+    c = tolower(c);
+  key += fmt::format("|{}|{}|{}", toString(type),
+                     local4 ? local4->toString() : "", local6 ? local6->toString() : "");
+  for(const auto& s : servers)
+    key += "|" + s.toStringWithPort();
+
+  std::promise<vector<ComboAddress>> promise;
+  {
+    std::unique_lock<std::mutex> l(s_dnsCacheLock);
+    time_t now = time(nullptr);
+    if(auto iter = s_dnsCache.find(key); iter != s_dnsCache.end()) {
+      if(now < iter->second.expire)
+        return iter->second.addresses;
+      s_dnsCache.erase(iter);
+    }
+    // someone is already asking, so we wait for their answer
+    if(auto iter = s_dnsInflight.find(key); iter != s_dnsInflight.end()) {
+      auto f = iter->second;
+      l.unlock();
+      return f.get();
     }
+    s_dnsInflight[key] = promise.get_future().share();
+  }
+
+  try {
+    auto ret = DNSResolveAtUncached(name, type, servers, local4, local6, ttl);
+    if(ttl == std::numeric_limits<uint32_t>::max())
+      ttl = c_negCacheTTL;
+    ttl = std::clamp(ttl, c_minCacheTTL, c_maxCacheTTL);
+    {
+      std::lock_guard<std::mutex> l(s_dnsCacheLock);
+      time_t now = time(nullptr);
+      // names nobody asks for anymore would otherwise stay forever
+      std::erase_if(s_dnsCache, [now](const auto& e) { return now >= e.second.expire; });
+      s_dnsCache[key] = {ret, now + ttl};
+      s_dnsInflight.erase(key);
+    }
+    promise.set_value(ret);
+    return ret;
+  }
+  catch(...) { // failures are not cached, the next lookup tries again
+    {
+      std::lock_guard<std::mutex> l(s_dnsCacheLock);
+      s_dnsInflight.erase(key);
+    }
+    promise.set_exception(std::current_exception());
+    throw;
   }
-  return ret;
 }
 
 
@@ -6,10 +6,13 @@
 #include <unistd.h> //unlink(), usleep()
 #include <unordered_map>
 #include "doctest.h"
+#include <openssl/evp.h>
+#include <openssl/x509.h>
 #include "httplib.h"
 #include "nlohmann/json.hpp"
 
 #include "simplomon.hh"
+#include "certcache.hh"
 
 using namespace std;
 vector<std::unique_ptr<Checker>> g_checkers;
@@ -21,3 +24,297 @@ TEST_CASE("alert filter test") {
   CHECK(1 == 1);
 }
 
+TEST_CASE("streamregex") {
+  // compare against std::regex, also when fed one byte at a time
+  for(string pattern : {"abc", "^abc", "abc$", "^$", "a.c", "(ab|cd)+e", "a{2,3}b", "[^a]b", "\\d+\\.\\d", "^(a|b)*$", "(?:ab)*c", "\\s$"}) {
+    StreamRegex sre(pattern);
+    std::regex re(pattern);
+    for(string str : {"", "abc", "xabcx", "aab", "aaab", "abcde", "cdabe", "b", "ab\nc", "1.5", "ababc", "x \n", "abab"}) {
+      INFO(pattern << " on " << str);
+      CHECK(sre.search(str) == std::regex_search(str, re));
+      StreamRegex::Search s(sre);
+      for(char c : str)
+        s.feed(string_view(&c, 1));
+      CHECK(s.finish() == std::regex_search(str, re));
+    }
+  }
+  CHECK(StreamRegex("Europe").getPrefix() == "Europe");
+  CHECK(StreamRegex("ab(c|d)").getPrefix() == "ab");
+  CHECK_THROWS_AS(StreamRegex("\\bword"), StreamRegex::Unsupported);
+  CHECK_THROWS_AS(StreamRegex("(a)\\1"), StreamRegex::Unsupported);
+  CHECK_THROWS_AS(StreamRegex("a(?=b)"), StreamRegex::Unsupported);
+}
+
+TEST_CASE("dnsname") {
+  DNSName a = makeDNSName("www.BertHub.eu"), b = makeDNSName("WWW.berthub.EU");
+  CHECK(a == b);
+  CHECK(a.hash() == b.hash());
+  CHECK(a.toString() == "www.BertHub.eu.");
+  CHECK(a.size() == 3);
+  CHECK(a.wire() == string_view("\3www\7BertHub\2eu", 16)); // includes the final 0
+  CHECK(a != makeDNSName("ww.berthub.eu"));
+  CHECK(makeDNSName("a.b") < makeDNSName("a.b.c"));
+  CHECK(makeDNSName("A.b") < makeDNSName("b.a"));
+  CHECK(!(makeDNSName("b.a") < makeDNSName("A.b")));
+  CHECK(a.isPartOf(makeDNSName("berthub.eu")));
+  CHECK(!a.isPartOf(makeDNSName("hub.eu")));
+  CHECK(a.makeRelative(makeDNSName("BERTHUB.eu")));
+  CHECK(a == makeDNSName("www"));
+  a = a + makeDNSName("example.com");
+  CHECK(a == makeDNSName("www.example.com"));
+  CHECK(a.front() == DNSLabel("www"));
+  CHECK(a.back() == DNSLabel("com"));
+  a.pop_back();
+  a.pop_front();
+  a.push_front("test");
+  CHECK(a == makeDNSName("test.example"));
+  a.clear();
+  CHECK(a.empty());
+  CHECK(a == DNSName());
+  CHECK(a.toString() == ".");
+  CHECK_THROWS(makeDNSName("a..b"));
+  CHECK_THROWS(a.push_back(DNSLabel(string(64, 'a'))));
+  CHECK_THROWS(a.push_front(DNSLabel(string(70, 'a'))));
+  CHECK_THROWS(makeDNSName(string(64, 'x') + ".example.com"));
+  a.push_back(DNSLabel(string(63, 'a')));
+  CHECK(a.size() == 1);
+}
+
+TEST_CASE("dnsmessageview") {
+  DNSName qname = makeDNSName("www.Example.com");
+  DNSMessageWriter dmw(qname, DNSType::A);
+  dmw.putRR(DNSSection::Answer, qname, 3600, CNAMEGen::make(makeDNSName("web.example.COM")));
+  dmw.putRR(DNSSection::Answer, makeDNSName("web.example.com"), 60, AGen::make("192.0.2.1"));
+  dmw.putRR(DNSSection::Authority, makeDNSName("example.com"), 300, NSGen::make(makeDNSName("ns.example.com")));
+  string packet = dmw.serialize();
+  DNSMessageView dmv(packet);
+  REQUIRE(dmv.size() == 3);
+  vector<DNSMessageView::RRView> rrs;
+  for(const auto& rr : dmv)
+    rrs.push_back(rr);
+  REQUIRE(rrs.size() == 3);
+  CHECK(rrs[0].type == DNSType::CNAME);
+  CHECK(rrs[2].section == DNSSection::Authority);
+  CHECK(rrs[2].ttl == 300);
+  // the owners are compression pointers, which get followed
+  CHECK(((uint8_t)packet[rrs[0].nameOffset] & 0xc0) == 0xc0);
+  CHECK(((uint8_t)packet[rrs[1].nameOffset] & 0xc0) == 0xc0);
+  CHECK(dmv.nameEquals(rrs[0].nameOffset, makeDNSName("WWW.example.com")));
+  CHECK(dmv.nameEquals(rrs[1].nameOffset, makeDNSName("web.example.com")));
+  CHECK(!dmv.nameEquals(rrs[1].nameOffset, makeDNSName("example.com")));
+  CHECK(!dmv.nameEquals(rrs[2].nameOffset, makeDNSName("www.example.com")));
+  CHECK(dmv.getName(rrs[2].nameOffset) == makeDNSName("example.com"));
+  CHECK(makeDNSName(dmv.getContent(rrs[0])->toString()) == makeDNSName("web.example.com"));
+  CHECK(dmv.getContent(rrs[1])->toString() == "192.0.2.1");
+  CHECK(dmv.isQuestion(makeDNSName("www.example.com"), DNSType::A));
+
+  CHECK(dmv.sameQuestion(DNSMessageView(DNSMessageWriter(makeDNSName("WWW.EXAMPLE.COM"), DNSType::A).serialize())));
+  CHECK(!dmv.sameQuestion(DNSMessageView(DNSMessageWriter(qname, DNSType::AAAA).serialize())));
+  CHECK(!dmv.sameQuestion(DNSMessageView(DNSMessageWriter(makeDNSName("www.example.co"), DNSType::A).serialize())));
+  CHECK(!dmv.sameQuestion(DNSMessageView(DNSMessageWriter(makeDNSName("wwx.example.com"), DNSType::A).serialize())));
+
+  auto walk = [](const string& p) {
+    DNSMessageView v(p);
+    for(const auto& rr : v)
+      (void)rr;
+  };
+  CHECK_NOTHROW(walk(packet));
+  CHECK_THROWS(walk(packet.substr(0, packet.size() - 1))); // rdata cut short
+  CHECK_THROWS(walk(packet.substr(0, packet.size() - 12))); // in the middle of the RR header
+  CHECK_THROWS(DNSMessageView(packet.substr(0, 20)));       // in the question
+  CHECK_THROWS(DNSMessageView(packet.substr(0, 11)));       // in the header
+
+  // the owner of the CNAME points at itself, and so does the name in its rdata
+  string loop("\0\0\x81\0\0\1\0\1\0\0\0\0" "\3www\0\0\1\0\1" "\xc0\x15\0\5\0\1\0\0\x0e\x10\0\2\xc0\x21", 35);
+  DNSMessageView lv(loop);
+  CHECK(lv.sameQuestion(DNSMessageView(DNSMessageWriter(makeDNSName("WWW"), DNSType::A).serialize())));
+  REQUIRE(lv.size() == 1);
+  auto rr = *lv.begin();
+  CHECK(rr.type == DNSType::CNAME);
+  CHECK_THROWS(lv.nameEquals(rr.nameOffset, makeDNSName("www")));
+  CHECK_THROWS(lv.getName(rr.nameOffset));
+  string out;
+  CHECK_THROWS(lv.getCanonicalRdata(rr, out));
+  CHECK_THROWS(lv.getContent(rr));
+}
+
+//! What DNSMessageView::getCanonicalRdata makes of rr, after it went through a DNS message
+static string canonicalRdata(const std::unique_ptr<RRGen>& rr, bool compress = true)
+{
+  DNSName qname = makeDNSName("Example.com");
+  DNSMessageWriter dmw(qname, rr->getType());
+  dmw.d_nocompress = !compress;
+  dmw.putRR(DNSSection::Answer, qname, 3600, rr);
+  string packet = dmw.serialize();
+  DNSMessageView dmv(packet);
+  string ret;
+  dmv.getCanonicalRdata(*dmv.begin(), ret);
+  return ret;
+}
+
+TEST_CASE("canonical rdata") {
+  // names in the rdata get compressed against the qname, and differ in case
+  auto mx = canonicalRdata(makeRRGen(DNSType::MX, "10 mx.example.COM"));
+  CHECK(mx == canonicalRdata(MXGen::make(10, makeDNSName("MX.Example.com")), false));
+  CHECK(mx == canonicalRdata(makeRRGen(DNSType::MX, "10 mx.example.com.")));
+  CHECK(mx != canonicalRdata(makeRRGen(DNSType::MX, "20 mx.example.com")));
+  CHECK(canonicalRdata(makeRRGen(DNSType::CNAME, "WWW.example.com")) ==
+        canonicalRdata(CNAMEGen::make(makeDNSName("www.EXAMPLE.com"))));
+
+  auto srv = makeRRGen(DNSType::SRV, "0 5 5060 SIP.example.com.");
+  CHECK(makeRRGen(DNSType::SRV, srv->toString())->toString() == srv->toString());
+  CHECK(canonicalRdata(srv) == canonicalRdata(std::make_unique<SRVGen>(0, 5, 5060, makeDNSName("sip.example.com"))));
+  CHECK(canonicalRdata(srv) != canonicalRdata(makeRRGen(DNSType::SRV, "0 5 5061 sip.example.com")));
+  auto mxgen = makeRRGen(DNSType::MX, "10 mx.example.com");
+  CHECK(makeRRGen(DNSType::MX, mxgen->toString())->toString() == mxgen->toString());
+
+  auto txt = makeRRGen(DNSType::TXT, "\"v=spf1\" \"-all\"");
+  CHECK(canonicalRdata(txt) == canonicalRdata(TXTGen::make({"v=spf1", "-all"})));
+  CHECK(canonicalRdata(txt) != canonicalRdata(TXTGen::make({"v=spf1 -all"})));
+
+  // the dns checker compares the text of these, like it always did
+  CHECK(!canMakeRRGen(DNSType::DS));
+  CHECK(canMakeRRGen(DNSType::NAPTR));
+  CHECK_THROWS(makeRRGen(DNSType::DS, "12345 13 2 ABCDEF"));
+
+  DNSStringReader a("10 mx.example.com"), b("x");
+  uint16_t prio;
+  a.xfrUInt16(prio);
+  b = a;
+  DNSName name;
+  b.xfrName(name);
+  CHECK(name == makeDNSName("mx.example.com"));
+}
+
+TEST_CASE("resolver order") {
+  ComboAddress slow("192.0.2.1", 53), fast("192.0.2.2", 53), fresh("192.0.2.3", 53), local("192.0.2.4", 53);
+  updateResolverStats(fast, 100);
+  CHECK(orderResolvers({fast})[0].second == 300); // srtt + 4 * rttvar, which starts at half the first RTT
+  updateResolverStats(fast, 200);
+  CHECK(orderResolvers({fast})[0].second == doctest::Approx(362.5)); // srtt 112.5, rttvar 62.5
+  updateResolverStats(slow, 1000);
+  updateResolverStats(local, 1);
+
+  auto order = orderResolvers({slow, fresh, fast, local});
+  REQUIRE(order.size() == 4);
+  CHECK(order[0].first == local);
+  CHECK(order[0].second == 10); // but never hedge that quickly
+  CHECK(order[1].first == fast);
+  CHECK(order[2].first == fresh);
+  CHECK(order[2].second == 250); // not heard from yet
+  CHECK(order[3].first == slow);
+  CHECK(order[3].second == 1500);
+
+  // a timeout doubles the srtt, to at least what unknown resolvers get
+  updateResolverStats(fast, std::nullopt);
+  order = orderResolvers({fresh, fast});
+  CHECK(order[0].first == fresh); // a tie, so they stay as they were
+  CHECK(order[1].second == doctest::Approx(500));
+  for(int n = 0; n < 4; ++n)
+    updateResolverStats(fast, std::nullopt);
+  CHECK(orderResolvers({fast, slow})[0].first == slow); // the doubling stops at the query timeout
+}
+
+TEST_CASE("compactzone") {
+  CompactZone::Builder b;
+  const uint8_t ip[4] = {192, 0, 2, 1};
+  // out of order, and in mixed case
+  for(const char* name : {"www", "b.a", "A", "mail", "x.B.a"})
+    b.add(makeDNSName(name), DNSType::A, 3600, ip);
+  b.add(makeDNSName("WWW"), DNSType::AAAA, 60, std::span<const uint8_t>(ip, 0));
+  b.add(DNSName(), DNSType::NS, 86400, ip);
+  auto z = b.finish();
+  CHECK(z->size() == 7);
+  CHECK(z->records(z->root()).size() == 1);
+  auto kids = z->children(z->root());
+  REQUIRE(kids.size() == 3);
+  CHECK(kids[0]->label == "A");
+  CHECK(kids[1]->label == "mail");
+  CHECK(kids[2]->label == "www");
+  auto node = z->find(makeDNSName("www"));
+  REQUIRE(node);
+  REQUIRE(z->records(*node).size() == 2);
+  CHECK(z->records(*node)[0].type == DNSType::A);
+  CHECK(z->records(*node)[1].type == DNSType::AAAA);
+  node = z->find(makeDNSName("X.b.a"));
+  REQUIRE(node);
+  CHECK(z->getName(*node) == makeDNSName("x.b.a"));
+  CHECK(z->records(*node)[0].getRdata()[3] == 1);
+  CHECK(!z->find(makeDNSName("c.a")));
+  CHECK(z->find(makeDNSName("b.a"))->numChildren == 1);
+}
+
+TEST_CASE("certcache resumed session") {
+  // a self-signed certificate, and a TLS 1.2 server and client talking over a BIO pair
+  std::shared_ptr<EVP_PKEY> key(EVP_EC_gen("P-256"), EVP_PKEY_free);
+  std::shared_ptr<X509> cert(X509_new(), X509_free);
+  X509_set_version(cert.get(), 2);
+  ASN1_INTEGER_set(X509_get_serialNumber(cert.get()), 1);
+  X509_gmtime_adj(X509_getm_notBefore(cert.get()), 0);
+  X509_gmtime_adj(X509_getm_notAfter(cert.get()), 30 * 86400);
+  X509_set_pubkey(cert.get(), key.get());
+  auto name = X509_get_subject_name(cert.get());
+  X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, (const unsigned char*)"resumed.example", -1, -1, 0);
+  X509_set_issuer_name(cert.get(), name);
+  REQUIRE(X509_sign(cert.get(), key.get(), EVP_sha256()) > 0);
+
+  std::shared_ptr<SSL_CTX> sctx(SSL_CTX_new(TLS_server_method()), SSL_CTX_free);
+  SSL_CTX_use_certificate(sctx.get(), cert.get());
+  SSL_CTX_use_PrivateKey(sctx.get(), key.get());
+  SSL_CTX_set_max_proto_version(sctx.get(), TLS1_2_VERSION);
+  std::shared_ptr<SSL_CTX> cctx(SSL_CTX_new(TLS_client_method()), SSL_CTX_free);
+
+  auto connect = [&](SSL_SESSION* sess, auto check) {
+    SSL* s = SSL_new(sctx.get());
+    SSL* c = SSL_new(cctx.get());
+    BIO *sbio, *cbio;
+    BIO_new_bio_pair(&sbio, 0, &cbio, 0);
+    SSL_set_bio(s, sbio, sbio);
+    SSL_set_bio(c, cbio, cbio);
+    SSL_set_accept_state(s);
+    SSL_set_connect_state(c);
+    if(sess)
+      SSL_set_session(c, sess);
+    for(int n = 0; n < 10 && !(SSL_is_init_finished(c) && SSL_is_init_finished(s)); ++n) {
+      SSL_do_handshake(c);
+      SSL_do_handshake(s);
+    }
+    REQUIRE(SSL_is_init_finished(c));
+    check(c);
+    SSL_SESSION* ret = SSL_get1_session(c);
+    SSL_shutdown(c);
+    SSL_shutdown(s);
+    SSL_free(c);
+    SSL_free(s);
+    return ret;
+  };
+
+  CertCache cc;
+  SSL_SESSION* first = connect(nullptr, [&](SSL* c) {
+    auto res = cc.lookup(c, "resumed.example");
+    CHECK(res.chain.size() == 1);
+    CHECK(res.hostOK);
+  });
+  // libcurl stores shared sessions serialized, which drops the peer chain but keeps the leaf
+  std::string der(i2d_SSL_SESSION(first, nullptr), '\0');
+  unsigned char* out = (unsigned char*)der.data();
+  i2d_SSL_SESSION(first, &out);
+  SSL_SESSION_free(first);
+  const unsigned char* in = (const unsigned char*)der.data();
+  SSL_SESSION* stored = d2i_SSL_SESSION(nullptr, &in, der.size());
+  REQUIRE(stored);
+
+  auto check = [](SSL* c, CertCache& cache) {
+    REQUIRE(SSL_session_reused(c));
+    auto res = cache.lookup(c, "resumed.example");
+    REQUIRE(res.chain.size() == 1);
+    CHECK(res.chain[0].notAfter - res.chain[0].notBefore == 30 * 86400);
+    CHECK(res.hostOK);
+    CHECK(!cache.lookup(c, "other.example").hostOK);
+  };
+  // once from what we saw before, once from the leaf alone
+  SSL_SESSION_free(connect(stored, [&](SSL* c) { check(c, cc); }));
+  CertCache empty;
+  SSL_SESSION_free(connect(stored, [&](SSL* c) { check(c, empty); }));
+  SSL_SESSION_free(stored);
+}